@@ -0,0 +1,512 @@
+// microbenchmark for buddy and slab allocator hot paths
+//
+// build (linux):   gcc -O2 -Iheader source/*.c bench/Benchmark.c -o benchmark -lpthread
+// run:             ./benchmark [max_threads] [memory_blocks] [zones] [arena]
+//
+// zones > 1 splits memory into that many buddy zones to simulate numa nodes,
+// threads of multi threaded runs are bound to zones round robin
+//
+// arena > 0 reserves memory with kmem_init_arena instead of malloc, as one zone:
+// 1 normal pages, 2 transparent huge pages, 3 huge page pool
+//
+// every result is printed as one csv line:
+//   bench,param,threads,ops,ns_per_op,ops_per_sec
+// malloc rows measure the system allocator with the same pattern
+// (run with LD_PRELOAD of another allocator to get its baseline)
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "BuddyAllocator.h"
+#include "Slab.h"
+#include "Arena.h"
+#include "Utility.h"
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <time.h>
+#endif
+
+#define BATCH (64)                  // objects allocated before they are freed
+#define ROUNDS (2000)               // batches per single threaded measurement
+#define MT_ROUNDS (2000)            // batches per thread in multi threaded measurement
+#define DEFAULT_BLOCKS (32768)      // 128MB of memory for allocator
+#define DEFAULT_MAX_THREADS (8)
+#define RING_SIZE (1024)            // slots in producer/consumer ring
+#define COLOR_SLABS (64)            // slabs whose first objects are walked by coloring benchmark
+#define COLOR_OBJ_SIZE (1536)       // object size that leaves several lines of unused space in each slab
+#define COLOR_ROUNDS (200000)       // walks over first objects of all slabs
+#define FRAG_SLABS (256)            // slabs filled before fragmentation benchmark frees objects
+#define FRAG_OBJ_SIZE (256)
+#define FRAG_CYCLES (4)             // swings of live objects in fragmentation benchmark
+
+//****************************************timing****************************************
+
+static double now_ns() {
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (double)cnt.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+static void report(const char* bench, const char* param, int threads, double ops, double ns) {
+	printf("%s,%s,%d,%.0f,%.2f,%.0f\n", bench, param, threads, ops, ns / ops, ops * 1e9 / ns);
+	fflush(stdout);
+}
+
+//****************************************threads***************************************
+
+typedef void* (*thread_fn)(void*);
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef struct { thread_fn fn; void* arg; } thread_start_t;
+static unsigned __stdcall thread_trampoline(void* p) {
+	thread_start_t* start = (thread_start_t*)p;
+	start->fn(start->arg);
+	free(start);
+	return 0;
+}
+static void thread_create(thread_t* t, thread_fn fn, void* arg) {
+	thread_start_t* start = (thread_start_t*)malloc(sizeof(thread_start_t));
+	start->fn = fn;
+	start->arg = arg;
+	*t = (HANDLE)_beginthreadex(NULL, 0, thread_trampoline, start, 0, NULL);
+}
+static void thread_join(thread_t t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+static void thread_yield() {
+	SwitchToThread();
+}
+#else
+typedef pthread_t thread_t;
+static void thread_create(thread_t* t, thread_fn fn, void* arg) {
+	pthread_create(t, NULL, fn, arg);
+}
+static void thread_join(thread_t t) {
+	pthread_join(t, NULL);
+}
+static void thread_yield() {
+	sched_yield();
+}
+#endif
+
+//*********************************single threaded paths*******************************
+
+static void bench_buddy() {
+	// b_alloc/b_free of BATCH blocks of every order that fits into memory
+	void* blocks[BATCH];
+	char param[32];
+
+	for (int order = 0; order <= 8; ++order) {
+		int block_num = (int)POW2(order);
+		int rounds = ROUNDS >> order;
+		if (rounds < 10) rounds = 10;
+
+		double start = now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			for (int i = 0; i < BATCH; ++i) {
+				blocks[i] = b_alloc(block_num);
+			}
+			for (int i = 0; i < BATCH; ++i) {
+				b_free(blocks[i], block_num);
+			}
+		}
+		double ns = now_ns() - start;
+
+		sprintf(param, "order-%d", order);
+		report("buddy_alloc_free", param, 1, 2.0 * rounds * BATCH, ns);
+	}
+}
+
+static void bench_cache() {
+	// kmem_cache_alloc/kmem_cache_free on caches with different object sizes
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+	void* objs[BATCH];
+	char name[CACHE_NAME_SIZE];
+
+	for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s) {
+		sprintf(name, "bench-%u", (unsigned)sizes[s]);
+		kmem_cache_t* cachep = kmem_cache_create(name, sizes[s], NULL, NULL);
+
+		double start = now_ns();
+		for (int r = 0; r < ROUNDS; ++r) {
+			for (int i = 0; i < BATCH; ++i) {
+				objs[i] = kmem_cache_alloc(cachep);
+			}
+			for (int i = 0; i < BATCH; ++i) {
+				kmem_cache_free(cachep, objs[i]);
+			}
+		}
+		double ns = now_ns() - start;
+
+		sprintf(name, "%u", (unsigned)sizes[s]);
+		report("cache_alloc_free", name, 1, 2.0 * ROUNDS * BATCH, ns);
+	}
+}
+
+// end of walk is stored so compiler can not drop it
+static void* volatile color_sink;
+
+static void bench_coloring() {
+	// first objects of many slabs of one cache are walked as a linked list
+	// without coloring they all start at the same offset in their blocks and compete for one set of L1
+	// with coloring they are spread over as many sets as the cache has colors
+	static const char* levels[] = { "off", "L1", "L2" };
+	char name[CACHE_NAME_SIZE];
+	char param[32];
+
+	for (int level = 0; level <= KMEM_COLOR_LEVELS; ++level) {
+		sprintf(name, "bench-color-%d", level);
+		kmem_cache_t* cachep = kmem_cache_create(name, COLOR_OBJ_SIZE, NULL, NULL);
+		kmem_cache_set_coloring(cachep, level);
+
+		// without magazines bulk allocation fills slabs in order, so object i * per_slab is first slot of a slab
+		kmem_cache_set_magazine_size(cachep, 0);
+		kmem_cache_stats_t stats;
+		kmem_cache_stats(cachep, &stats);
+		unsigned total = COLOR_SLABS * stats.objects_per_slab;
+		void** objs = (void**)malloc(total * sizeof(void*));
+		if (!objs || kmem_cache_alloc_bulk(cachep, total, objs) != total) {
+			printf("ERROR: coloring benchmark could not allocate objects\n");
+			free(objs);
+			return;
+		}
+
+		// every first object points to first object of next slab
+		for (unsigned i = 0; i < COLOR_SLABS; ++i) {
+			*(void**)objs[i * stats.objects_per_slab] = objs[((i + 1) % COLOR_SLABS) * stats.objects_per_slab];
+		}
+
+		void* p = objs[0];
+		double start = now_ns();
+		for (int r = 0; r < COLOR_ROUNDS; ++r) {
+			for (int i = 0; i < COLOR_SLABS; ++i) {
+				p = *(void**)p;
+			}
+		}
+		double ns = now_ns() - start;
+		color_sink = p;
+
+		kmem_cache_stats(cachep, &stats);
+		sprintf(param, "%s-%u-colors", levels[level], stats.colors);
+		report("cache_coloring_walk", param, 1, (double)COLOR_ROUNDS * COLOR_SLABS, ns);
+
+		kmem_cache_free_bulk(cachep, total, objs);
+		kmem_cache_destroy(cachep);
+		free(objs);
+	}
+}
+
+static unsigned frag_random(unsigned* state) {
+	// xorshift, same sequence on every run
+	unsigned x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void bench_fragmentation() {
+	// cache is filled, then live objects swing between 1/4 and 1/2 of it: random frees down, allocations back up
+	// partial list policy decides in how many slabs live objects gather, the rest go empty at every low point
+	char param[32];
+
+	kmem_cache_t* cachep = kmem_cache_create("bench-frag", FRAG_OBJ_SIZE, NULL, NULL);
+	kmem_cache_set_magazine_size(cachep, 0);
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cachep, &stats);
+	unsigned total = FRAG_SLABS * stats.objects_per_slab;
+	void** objs = (void**)malloc(total * sizeof(void*));
+	if (!objs || kmem_cache_alloc_bulk(cachep, total, objs) != total) {
+		printf("ERROR: fragmentation benchmark could not allocate objects\n");
+		free(objs);
+		return;
+	}
+
+	unsigned seed = 12345;
+	unsigned live = total;
+	double ops = 0;
+	double start = now_ns();
+	for (int c = 0; c < FRAG_CYCLES; ++c) {
+		if (c > 0) {
+			while (live < total / 2) {
+				objs[live++] = kmem_cache_alloc(cachep);
+				ops++;
+			}
+		}
+		while (live > total / 4) {
+			unsigned i = frag_random(&seed) % live;
+			kmem_cache_free(cachep, objs[i]);
+			objs[i] = objs[--live];
+			ops++;
+		}
+	}
+	double ns = now_ns() - start;
+
+	kmem_cache_stats(cachep, &stats);
+	sprintf(param, "%u", FRAG_OBJ_SIZE);
+	report("cache_fragmentation_cycle", param, 1, ops, ns);
+	printf("# bench-frag: %u live objects in %u of %u slabs, %u partial slabs with %u free slots, %u empty slabs\n",
+		stats.active_objs, stats.slab_count - stats.empty_slabs, stats.slab_count, stats.partial_slabs, stats.partial_free_objs, stats.empty_slabs);
+
+	kmem_cache_free_bulk(cachep, live, objs);
+	kmem_cache_destroy(cachep);
+	free(objs);
+}
+
+static void bench_kmalloc() {
+	// kmalloc/kfree and malloc/free on every small buffer size class
+	// and on a size between it and previous class, which is rounded up trough lookup table
+	void* objs[BATCH];
+	char param[32];
+
+	for (unsigned i = 0; i < 2 * SMALL_BUFFER_NUM; ++i) {
+		size_t class_size = small_buffer_class_size(i / 2);
+		size_t prev_size = (i / 2 > 0) ? small_buffer_class_size(i / 2 - 1) : 0;
+		size_t size = (i % 2) ? class_size : prev_size + (class_size - prev_size) / 2 + 1;
+		int rounds = (size > POW2(12)) ? ROUNDS / 16 : ROUNDS;
+		sprintf(param, "%u", (unsigned)size);
+
+		double start = now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			for (int k = 0; k < BATCH; ++k) {
+				objs[k] = kmalloc(size);
+			}
+			for (int k = 0; k < BATCH; ++k) {
+				kfree(objs[k]);
+			}
+		}
+		report("kmalloc_kfree", param, 1, 2.0 * rounds * BATCH, now_ns() - start);
+
+		start = now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			for (int k = 0; k < BATCH; ++k) {
+				objs[k] = malloc(size);
+			}
+			for (int k = 0; k < BATCH; ++k) {
+				free(objs[k]);
+			}
+		}
+		report("malloc_free", param, 1, 2.0 * rounds * BATCH, now_ns() - start);
+	}
+}
+
+//**********************************multi threaded paths********************************
+
+// multi threaded runs go trough kmalloc so all threads hit the same size class cache
+typedef struct bench_arg {
+	int use_malloc;                  // 1 for malloc baseline, 0 for kmalloc
+	kmem_cache_t* cachep;            // if not NULL objects come from this cache instead of kmalloc
+	size_t size;                     // object size
+	struct ring* ring;               // ring shared by producer and consumer
+	int zone;                        // buddy zone the thread allocates from first
+}bench_arg_t;
+
+static void* bench_alloc(bench_arg_t* arg) {
+	if (arg->use_malloc) return malloc(arg->size);
+	return arg->cachep ? kmem_cache_alloc(arg->cachep) : kmalloc(arg->size);
+}
+
+static void bench_free(bench_arg_t* arg, void* objp) {
+	if (arg->use_malloc) free(objp);
+	else if (arg->cachep) kmem_cache_free(arg->cachep, objp);
+	else kfree(objp);
+}
+
+static void* local_worker(void* p) {
+	// every thread frees what it allocated
+	bench_arg_t* arg = (bench_arg_t*)p;
+	void* objs[BATCH];
+	b_set_thread_zone(arg->zone);
+	for (int r = 0; r < MT_ROUNDS; ++r) {
+		for (int i = 0; i < BATCH; ++i) {
+			objs[i] = bench_alloc(arg);
+		}
+		for (int i = 0; i < BATCH; ++i) {
+			bench_free(arg, objs[i]);
+		}
+	}
+	return NULL;
+}
+
+#ifdef _MSC_VER
+// volatile accesses have acquire/release semantics with msvc
+#define LOAD_ACQUIRE(p) (*(p))
+#define STORE_RELEASE(p, v) (*(p) = (v))
+#else
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+static void ring_wait(int* spins) {
+	// spin for a while, then give the cpu to the other side of the ring
+	if (++(*spins) < 1000) {
+		cpu_relax();
+	}
+	else {
+		thread_yield();
+		*spins = 0;
+	}
+}
+
+// single producer single consumer ring of object pointers
+typedef struct ring {
+	void* volatile slots[RING_SIZE];
+	volatile long head;              // next slot to be written by producer
+	volatile long tail;              // next slot to be read by consumer
+}ring_t;
+
+static void* producer(void* p) {
+	// allocates objects and hands them over to consumer thread
+	bench_arg_t* arg = (bench_arg_t*)p;
+	ring_t* ring = arg->ring;
+	b_set_thread_zone(arg->zone);
+	for (long n = 0; n < (long)MT_ROUNDS * BATCH; ++n) {
+		void* objp = bench_alloc(arg);
+		int spins = 0;
+		while (ring->head - LOAD_ACQUIRE(&ring->tail) >= RING_SIZE) {
+			ring_wait(&spins);
+		}
+		ring->slots[ring->head % RING_SIZE] = objp;
+		STORE_RELEASE(&ring->head, ring->head + 1);
+	}
+	return NULL;
+}
+
+static void* consumer(void* p) {
+	// frees objects allocated by producer thread
+	bench_arg_t* arg = (bench_arg_t*)p;
+	ring_t* ring = arg->ring;
+	b_set_thread_zone(arg->zone);
+	for (long n = 0; n < (long)MT_ROUNDS * BATCH; ++n) {
+		int spins = 0;
+		while (LOAD_ACQUIRE(&ring->head) == ring->tail) {
+			ring_wait(&spins);
+		}
+		void* objp = ring->slots[ring->tail % RING_SIZE];
+		STORE_RELEASE(&ring->tail, ring->tail + 1);
+		bench_free(arg, objp);
+	}
+	return NULL;
+}
+
+static void run_threads(const char* bench, const char* param, int threads, int use_malloc, size_t size, int pairs, kmem_cache_t* cachep) {
+	// pairs = 1 runs threads/2 producer/consumer pairs, else threads local workers
+	thread_t tids[2 * DEFAULT_MAX_THREADS * 8];
+	bench_arg_t args[2 * DEFAULT_MAX_THREADS * 8];
+	ring_t* rings = (ring_t*)calloc(threads, sizeof(ring_t));
+	if (!rings) return;
+
+	double start = now_ns();
+	for (int t = 0; t < threads; ++t) {
+		args[t].use_malloc = use_malloc;
+		args[t].cachep = cachep;
+		args[t].size = size;
+		args[t].ring = &rings[t / 2];
+		args[t].zone = (pairs ? t / 2 : t) % b_zone_count();
+		thread_create(&tids[t], pairs ? ((t % 2 == 0) ? producer : consumer) : local_worker, &args[t]);
+	}
+	for (int t = 0; t < threads; ++t) {
+		thread_join(tids[t]);
+	}
+	double ns = now_ns() - start;
+
+	// local workers do alloc and free, in pairs only producers allocate and only consumers free
+	double ops = pairs ? (double)threads * MT_ROUNDS * BATCH : 2.0 * threads * MT_ROUNDS * BATCH;
+	report(bench, param, threads, ops, ns);
+	free(rings);
+}
+
+static void bench_threads(int max_threads) {
+	static const size_t sizes[] = { 64, 128 };
+	char param[32];
+
+	for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s) {
+		sprintf(param, "%u", (unsigned)sizes[s]);
+
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			run_threads("mt_kmalloc_local", param, threads, 0, sizes[s], 0, NULL);
+			run_threads("mt_malloc_local", param, threads, 1, sizes[s], 0, NULL);
+		}
+		for (int threads = 2; threads <= max_threads; threads *= 2) {
+			run_threads("mt_kmalloc_producer_consumer", param, threads, 0, sizes[s], 1, NULL);
+			run_threads("mt_malloc_producer_consumer", param, threads, 1, sizes[s], 1, NULL);
+		}
+	}
+
+	// without magazines every operation goes to slab layer, threads of one cache only share its short list lock
+	// frees that find list lock taken use remote free maps
+	kmem_cache_t* cachep = kmem_cache_create("bench-nomag", 64, NULL, NULL);
+	kmem_cache_set_magazine_size(cachep, 0);
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		run_threads("mt_cache_nomag_local", "64", threads, 0, 64, 0, cachep);
+	}
+	for (int threads = 2; threads <= max_threads; threads *= 2) {
+		run_threads("mt_cache_nomag_producer_consumer", "64", threads, 0, 64, 1, cachep);
+	}
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cachep, &stats);
+	printf("# bench-nomag: %lu of %lu frees were remote\n", stats.remote_frees, stats.frees);
+}
+
+int main(int argc, char** argv) {
+
+	int max_threads = (argc > 1) ? atoi(argv[1]) : DEFAULT_MAX_THREADS;
+	int blocks = (argc > 2) ? atoi(argv[2]) : DEFAULT_BLOCKS;
+	int zones = (argc > 3) ? atoi(argv[3]) : 1;
+	int arena = (argc > 4) ? atoi(argv[4]) : 0;
+	if (arena) zones = 1;
+	if (zones < 1) zones = 1;
+	if (zones > BUDDY_ZONE_MAX) zones = BUDDY_ZONE_MAX;
+	if (max_threads < 1) max_threads = 1;
+	if (max_threads > DEFAULT_MAX_THREADS * 8) max_threads = DEFAULT_MAX_THREADS * 8;
+
+	void* space = NULL;
+	if (arena) {
+		// arena - 1 are ARENA_* flags, arena is always a single zone
+		space = kmem_init_arena((size_t)blocks * BLOCK_SIZE, arena - 1);
+		if (!space) {
+			return 1;
+		}
+	}
+	else {
+		space = malloc((size_t)blocks * BLOCK_SIZE);
+		if (!space) {
+			printf("ERROR: could not get %d blocks of memory\n", blocks);
+			return 1;
+		}
+		// every zone gets an equal part of memory, zone i acts as numa node i
+		int zone_blocks = blocks / zones;
+		kmem_init(space, zone_blocks);
+		for (int z = 1; z < zones; ++z) {
+			kmem_add_zone((char*)space + (size_t)z * zone_blocks * BLOCK_SIZE, zone_blocks, z);
+		}
+	}
+
+	printf("bench,param,threads,ops,ns_per_op,ops_per_sec\n");
+	bench_buddy();
+	bench_cache();
+	bench_coloring();
+	bench_fragmentation();
+	bench_kmalloc();
+	bench_threads(max_threads);
+
+	if (arena) {
+		arena_release(space, (size_t)blocks * BLOCK_SIZE);
+	}
+	else {
+		free(space);
+	}
+	return 0;
+}
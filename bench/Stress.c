@@ -0,0 +1,347 @@
+// multi threaded stress test for buddy and slab allocator
+//
+// build (linux):   gcc -O2 -Iheader source/*.c bench/Stress.c -o stress -lpthread
+// run:             ./stress [threads] [seconds] [memory_blocks]
+//
+// every thread does random:
+//   kmalloc/kfree of small and large sizes, part of them freed by other threads
+//   kmem_cache_alloc/kmem_cache_free on caches shared by all threads
+//   kmem_cache_create/kmem_cache_destroy of its own caches
+//   kmem_cache_shrink of shared caches
+// rarely an object is freed twice, or a pointer that is not an object of the cache is freed,
+// allocator must reject such frees and leave live objects alone
+// objects carry a tag of their address and owner that is checked before free,
+// so objects that overlap or are handed out twice are caught
+// main thread runs kmem_check_consistency while workers run and once after they stop
+// exit code is 1 if any check found an error
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "BuddyAllocator.h"
+#include "Slab.h"
+#include "Utility.h"
+
+#define DEFAULT_THREADS (4)
+#define DEFAULT_SECONDS (10)
+#define DEFAULT_BLOCKS (32768)      // 128MB of memory for allocator
+#define MAX_THREADS (64)
+#define LIVE_SLOTS (512)            // objects one thread keeps allocated at most
+#define SHARED_CACHES (4)           // caches used by all threads, one of them with constructor
+#define OWN_CACHES (2)              // caches every thread creates and destroys itself
+#define EXCHANGE_SLOTS (64)         // kmalloc objects handed between threads, freed by the one that takes them
+#define CHECK_INTERVAL_MS (200)     // time between consistency checks of main thread
+#define NEGATIVE_RATE (64)          // one of this many rare operations frees an object wrongly on purpose
+#define CTOR_MAGIC (0x5a5a5a5a5a5a5a5aull)
+
+typedef struct live_obj {
+	uint64_t* obj;
+	kmem_cache_t* cachep;           // NULL for kmalloc objects
+	size_t size;
+}live_obj_t;
+
+typedef struct worker {
+	kthread_t thread;
+	unsigned id;
+	uint64_t rng;
+	live_obj_t live[LIVE_SLOTS];
+	kmem_cache_t* own[OWN_CACHES];
+	unsigned own_created;           // caches created so far, used for unique names
+	long ops;
+	long double_frees;
+	long foreign_frees;
+	long errors;
+}worker_t;
+
+static kmem_cache_t* shared[SHARED_CACHES];
+static size_t shared_size[SHARED_CACHES] = { 24, 136, 1000, 4096 };
+static void* exchange[EXCHANGE_SLOTS];
+static spinlock_t exchange_lock;
+static volatile long stop = 0;
+static volatile long errors = 0;
+
+//*****************************************helpers****************************************
+
+static uint64_t rnd(worker_t* w) {
+	// xorshift64, one generator per thread
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 7;
+	w->rng ^= w->rng << 17;
+	return w->rng;
+}
+
+static uint64_t obj_tag(void* obj, live_obj_t* owner) {
+	// tag depends on address and owning slot, object that overlaps another one
+	// or is given to two slots gets a wrong tag
+	return ((uint64_t)(uintptr_t)obj ^ ((uint64_t)(uintptr_t)owner << 1)) * 0x9e3779b97f4a7c15ull;
+}
+
+static void ctor_magic(void* obj) {
+	*(uint64_t*)obj = CTOR_MAGIC;
+}
+
+static void tag_obj(live_obj_t* slot) {
+	// first and last word of object hold its tag
+	slot->obj[0] = obj_tag(slot->obj, slot);
+	slot->obj[slot->size / sizeof(uint64_t) - 1] = obj_tag(slot->obj, slot);
+}
+
+static int check_tag(worker_t* w, live_obj_t* slot) {
+	uint64_t* obj = slot->obj;
+	uint64_t tag = obj_tag(obj, slot);
+	if (obj[0] != tag || obj[slot->size / sizeof(uint64_t) - 1] != tag) {
+		printf("ERROR in stress: %s object %p of %u bytes was overwritten\n", slot->cachep ? slot->cachep->name : "kmalloc", (void*)obj, (unsigned)slot->size);
+		w->errors++;
+		return 1;
+	}
+	return 0;
+}
+
+static size_t random_kmalloc_size(worker_t* w) {
+	// mostly small sizes of any class, few large buffers taken from buddy allocator
+	if (rnd(w) % 64 == 0) {
+		return POW2(SMALL_BUFFER_UPPER_LIMIT) + rnd(w) % (4 * BLOCK_SIZE);
+	}
+	int order = 4 + (int)(rnd(w) % (SMALL_BUFFER_UPPER_LIMIT - 3));
+	return POW2(order - 1) + rnd(w) % POW2(order - 1);
+}
+
+//****************************************operations**************************************
+
+static void obj_alloc(worker_t* w, live_obj_t* slot) {
+	unsigned choice = (unsigned)(rnd(w) % (SHARED_CACHES + OWN_CACHES + 2));
+
+	if (choice < SHARED_CACHES) {
+		slot->cachep = shared[choice];
+		slot->size = shared_size[choice];
+	}
+	else if (choice < SHARED_CACHES + OWN_CACHES && w->own[choice - SHARED_CACHES]) {
+		slot->cachep = w->own[choice - SHARED_CACHES];
+		slot->size = slot->cachep->obj_size;
+	}
+	else {
+		slot->cachep = NULL;
+		slot->size = random_kmalloc_size(w);
+	}
+
+	slot->obj = slot->cachep ? (uint64_t*)kmem_cache_alloc(slot->cachep) : (uint64_t*)kmalloc(slot->size);
+	if (!slot->obj) {
+		// memory is full, objects of other slots will be freed by later operations
+		return;
+	}
+
+	// constructed objects must come out of cache in constructed state
+	if (slot->cachep == shared[0] && slot->obj[0] != CTOR_MAGIC) {
+		printf("ERROR in stress: object %p of constructed cache is not constructed\n", (void*)slot->obj);
+		w->errors++;
+	}
+	tag_obj(slot);
+}
+
+static void obj_free(worker_t* w, live_obj_t* slot) {
+	check_tag(w, slot);
+
+	if (slot->cachep == shared[0]) {
+		ctor_magic(slot->obj);
+	}
+
+	if (slot->cachep) {
+		kmem_cache_free(slot->cachep, slot->obj);
+	}
+	else if (rnd(w) % 4 == 0) {
+		// object is handed to another thread, object that was waiting in its place is freed here
+		unsigned index = (unsigned)(rnd(w) % EXCHANGE_SLOTS);
+		spin_lock(&exchange_lock);
+		uint64_t* other = (uint64_t*)exchange[index];
+		exchange[index] = slot->obj;
+		spin_unlock(&exchange_lock);
+		if (other) {
+			kfree(other);
+		}
+	}
+	else {
+		kfree(slot->obj);
+	}
+	slot->obj = NULL;
+}
+
+static void double_free(worker_t* w) {
+	// object of cache without constructor is freed twice in a row, second free must be rejected
+	// and object must not be handed out twice, which tags of later allocations would show
+	kmem_cache_t* cachep = shared[1 + rnd(w) % (SHARED_CACHES - 1)];
+	void* obj = kmem_cache_alloc(cachep);
+	if (!obj) {
+		return;
+	}
+	kmem_cache_free(cachep, obj);
+	kmem_cache_free(cachep, obj);
+	w->double_frees++;
+
+	// magazines are LIFO, object that got in twice comes out of next two allocations
+	void* first = kmem_cache_alloc(cachep);
+	void* second = kmem_cache_alloc(cachep);
+	if (first && first == second) {
+		printf("ERROR in stress: object %p freed twice is handed out twice\n", first);
+		w->errors++;
+		second = NULL;
+	}
+	if (first) kmem_cache_free(cachep, first);
+	if (second) kmem_cache_free(cachep, second);
+}
+
+static void foreign_free(worker_t* w, live_obj_t* slot) {
+	// frees pointers that are not objects of the cache they are freed to
+	// live object of the slot must survive all of them, its tag is checked when it is really freed
+	int local = 0;
+	char* inside = (char*)slot->obj + sizeof(uint64_t);
+	kmem_cache_t* other = (slot->cachep == shared[1]) ? shared[2] : shared[1];
+
+	kmem_cache_free(other, slot->obj);
+	if (slot->cachep) {
+		kmem_cache_free(slot->cachep, inside);
+	}
+	else {
+		kfree(inside);
+	}
+	kfree(&local);
+	w->foreign_frees++;
+}
+
+static void own_cache_cycle(worker_t* w) {
+	// destroys one own cache with all its objects and creates a new one of random size
+	unsigned index = (unsigned)(rnd(w) % OWN_CACHES);
+	kmem_cache_t* cachep = w->own[index];
+
+	if (cachep) {
+		for (int i = 0; i < LIVE_SLOTS; ++i) {
+			if (w->live[i].obj && w->live[i].cachep == cachep) {
+				obj_free(w, &w->live[i]);
+			}
+		}
+		w->own[index] = NULL;
+		kmem_cache_destroy(cachep);
+	}
+
+	char name[CACHE_NAME_SIZE];
+	sprintf(name, "stress-%u-%u", w->id, w->own_created++);
+	w->own[index] = kmem_cache_create(name, 16 + (size_t)(rnd(w) % 2048), NULL, NULL);
+}
+
+static KTHREAD_RETURN worker_main(void* arg) {
+	worker_t* w = (worker_t*)arg;
+
+	while (!atomic_load_full(&stop)) {
+
+		unsigned op = (unsigned)(rnd(w) % 1024);
+		live_obj_t* slot = &w->live[rnd(w) % LIVE_SLOTS];
+
+		if (op == 0) {
+			own_cache_cycle(w);
+		}
+		else if (op == 1) {
+			kmem_cache_shrink(shared[rnd(w) % SHARED_CACHES]);
+		}
+		else if (op == 2 && rnd(w) % NEGATIVE_RATE == 0) {
+			double_free(w);
+		}
+		else if (op == 3 && slot->obj && rnd(w) % NEGATIVE_RATE == 0) {
+			foreign_free(w, slot);
+		}
+		else if (slot->obj) {
+			obj_free(w, slot);
+		}
+		else {
+			obj_alloc(w, slot);
+		}
+		w->ops++;
+	}
+
+	// everything this thread holds goes back before consistency is checked last time
+	for (int i = 0; i < LIVE_SLOTS; ++i) {
+		if (w->live[i].obj) {
+			obj_free(w, &w->live[i]);
+		}
+	}
+	for (int i = 0; i < OWN_CACHES; ++i) {
+		if (w->own[i]) {
+			kmem_cache_destroy(w->own[i]);
+		}
+	}
+
+	atomic_add_full(&errors, w->errors);
+	return KTHREAD_RETURN_VALUE;
+}
+
+//*******************************************main*****************************************
+
+int main(int argc, char** argv) {
+	int threads = (argc > 1) ? atoi(argv[1]) : DEFAULT_THREADS;
+	int seconds = (argc > 2) ? atoi(argv[2]) : DEFAULT_SECONDS;
+	int blocks = (argc > 3) ? atoi(argv[3]) : DEFAULT_BLOCKS;
+	if (threads < 1) threads = 1;
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+	void* space = malloc((size_t)blocks * BLOCK_SIZE);
+	if (!space) {
+		printf("ERROR in stress: could not get %d blocks of memory\n", blocks);
+		return 1;
+	}
+	kmem_init(space, blocks);
+	spin_init(&exchange_lock);
+
+	char name[CACHE_NAME_SIZE];
+	for (int i = 0; i < SHARED_CACHES; ++i) {
+		sprintf(name, "stress-shared-%d", i);
+		shared[i] = kmem_cache_create(name, shared_size[i], (i == 0) ? ctor_magic : NULL, NULL);
+		if (!shared[i]) {
+			printf("ERROR in stress: could not create shared cache %s\n", name);
+			return 1;
+		}
+	}
+
+	worker_t* workers = (worker_t*)calloc(threads, sizeof(worker_t));
+	for (int i = 0; i < threads; ++i) {
+		workers[i].id = (unsigned)i;
+		workers[i].rng = 0x2545f4914f6cdd1dull * (uint64_t)(i + 1);
+		if (kthread_start(&workers[i].thread, worker_main, &workers[i]) != 0) {
+			printf("ERROR in stress: could not start thread %d\n", i);
+			return 1;
+		}
+	}
+
+	// consistency is checked while workers change every structure
+	long checks = 0;
+	for (int elapsed = 0; elapsed < seconds * 1000; elapsed += CHECK_INTERVAL_MS) {
+		kthread_sleep_ms(CHECK_INTERVAL_MS);
+		atomic_add_full(&errors, kmem_check_consistency());
+		checks++;
+	}
+
+	atomic_add_full(&stop, 1);
+	long ops = 0, double_frees = 0, foreign_frees = 0;
+	for (int i = 0; i < threads; ++i) {
+		kthread_join(workers[i].thread);
+		ops += workers[i].ops;
+		double_frees += workers[i].double_frees;
+		foreign_frees += workers[i].foreign_frees;
+	}
+
+	// objects left in exchange slots belong to nobody now
+	for (int i = 0; i < EXCHANGE_SLOTS; ++i) {
+		if (exchange[i]) {
+			kfree(exchange[i]);
+		}
+	}
+	for (int i = 0; i < SHARED_CACHES; ++i) {
+		kmem_cache_destroy(shared[i]);
+	}
+	atomic_add_full(&errors, kmem_check_consistency());
+
+	printf("threads %d, ops %ld, double frees %ld, foreign frees %ld, checks %ld, errors %ld\n", threads, ops, double_frees, foreign_frees, checks + 1, errors);
+
+	free(workers);
+	free(space);
+	return errors ? 1 : 0;
+}
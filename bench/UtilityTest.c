@@ -0,0 +1,95 @@
+// boundary test for bit helpers of header/Utility.h
+//
+// build (linux):   gcc -O2 -Iheader bench/UtilityTest.c -o utilitytest
+// run:             ./utilitytest
+//
+// every helper is compared with a plain loop reference on 0, 1 and on
+// 2^k - 1, 2^k, 2^k + 1 for every k up to 63
+// every mismatch is printed, exit code is number of mismatches (0 when all pass)
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include "Utility.h"
+
+static int errors = 0;
+
+static int ref_lower_log2(uint64_t x) {
+	// floor(log2(x)) by shifting, x must not be 0
+	int n = 0;
+	while (x >>= 1) {
+		n++;
+	}
+	return n;
+}
+
+static int ref_higher_log2(uint64_t x) {
+	// ceil(log2(x)) by doubling, 0 for x <= 1
+	int n = 0;
+	uint64_t p = 1;
+	while (p < x && n < 64) {
+		p <<= 1;
+		n++;
+	}
+	return n;
+}
+
+static uint64_t ref_pow2(int n) {
+	// 2 ^ n by multiplying
+	uint64_t p = 1;
+	for (int i = 0; i < n; ++i) {
+		p *= 2;
+	}
+	return p;
+}
+
+static uint64_t ref_div_round_up(uint64_t x, uint64_t y) {
+	// ceil(x / y) without forming x + y - 1
+	return x / y + (x % y != 0);
+}
+
+static void check(const char* func, uint64_t x, uint64_t y, uint64_t got, uint64_t expected) {
+	if (got != expected) {
+		printf("ERROR in %s: x = %llu, y = %llu, got %llu, expected %llu\n", func,
+			(unsigned long long)x, (unsigned long long)y, (unsigned long long)got, (unsigned long long)expected);
+		errors++;
+	}
+}
+
+static void check_value(uint64_t x) {
+	// all helpers on one input, div_round_up with small, block sized and power of 2 divisors
+	if (x != 0) {
+		check("closest_lower_log2", x, 0, (uint64_t)closest_lower_log2((size_t)x), (uint64_t)ref_lower_log2(x));
+	}
+	check("closest_higher_log2", x, 0, (uint64_t)closest_higher_log2((size_t)x), (uint64_t)ref_higher_log2(x));
+
+	uint64_t divisors[] = { 1, 3, 4096, x ? x : 1, (uint64_t)1 << 32, (uint64_t)1 << 63 };
+	for (unsigned i = 0; i < sizeof(divisors) / sizeof(divisors[0]); ++i) {
+		check("div_round_up", x, divisors[i], (uint64_t)div_round_up((size_t)x, (size_t)divisors[i]), ref_div_round_up(x, divisors[i]));
+	}
+}
+
+int main() {
+
+	check_value(0);
+	check_value(1);
+
+	for (int k = 1; k <= 63; ++k) {
+		uint64_t p = (uint64_t)1 << k;
+		check_value(p - 1);
+		check_value(p);
+		check_value(p + 1);
+	}
+
+	for (int k = 0; k <= 63; ++k) {
+		check("POW2", (uint64_t)k, 0, (uint64_t)POW2(k), ref_pow2(k));
+	}
+
+	if (errors) {
+		printf("%d mismatches\n", errors);
+	}
+	else {
+		printf("all checks passed\n");
+	}
+	return errors;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include"BuddyAllocator.h"
+
+// built-in backing store for buddy zones
+//
+// address range is only reserved up front, buddy allocator commits it in chunks
+// when blocks are handed out, and purges chunks that become completely free
+// on linux memory is reserved with mmap(PROT_NONE), committed with mprotect and purged with MADV_DONTNEED
+// on windows the same is done with VirtualAlloc(MEM_RESERVE), VirtualAlloc(MEM_COMMIT) and VirtualAlloc(MEM_RESET)
+
+#define ARENA_HUGEPAGE (1)          // ask for transparent huge pages (madvise(MADV_HUGEPAGE)), linux only
+#define ARENA_HUGETLB (2)           // take memory from reserved huge page pool (MAP_HUGETLB), linux only, falls back to normal pages
+#define ARENA_CHUNK_SIZE (POW2(BUDDY_CHUNK_ORDER + BLOCK_BIT_NUM)) // granularity of commit and purge, same as huge page size
+
+extern const buddy_backing_t arena_backing;         //backing of reservations made with normal pages
+extern const buddy_backing_t arena_hugetlb_backing; //backing of reservations made with MAP_HUGETLB
+
+void* arena_reserve(size_t size, int flags, const buddy_backing_t** backing); //reserves size bytes aligned to ARENA_CHUNK_SIZE, returns backing to use for it
+void arena_release(void* addr, size_t size);       //unmaps range returned by arena_reserve
+static int arena_commit(void* addr, size_t size);  //makes reserved range readable and writable
+static void arena_purge(void* addr, size_t size);  //drops physical pages of range, range stays accessible
+static int arena_hugetlb_commit(void* addr, size_t size); //huge pages are filled in by the kernel on first touch
+static void arena_hugetlb_purge(void* addr, size_t size); //drops whole huge pages inside of range
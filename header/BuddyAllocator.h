@@ -1,13 +1,27 @@
 #pragma once
 #include<stdio.h>
 #include<stdlib.h>
-#include<Windows.h>
+#include<stdint.h>
+#include"Sync.h"
 
 #define BLOCK_SIZE (4096)           // fixed size of allocation block
 #define BLOCK_BIT_NUM (12)          // 2 ^ 12 = BLOCK_SIZE 
 #define STEP_SIZE (1024)            // (BLOCK_SIZE/4) used for pointer arithmetic with 4B pointers 
 #define STEP_BIT_NUM (10)           // 2 ^ 10 = STEP_SIZE
 #define BUDDY_SIZE (32)             // size of buddies[] array. this allows 2^32 * 4096B = ~17TB
+#define BUDDY_ZONE_MAX (8)          // max number of memory zones (for example one per numa node)
+#define BUDDY_PCP_NUM (16)          // number of per-thread lists of free blocks
+#define BUDDY_PCP_ORDERS (2)        // orders 0 and 1 are served from per-thread lists
+#define BUDDY_PCP_HIGH (32)         // per-thread list is spilled to buddy lists when it grows above this
+#define BUDDY_PCP_BATCH (16)        // number of blocks moved between per-thread list and buddy lists at once
+#define BUDDY_CHUNK_ORDER (9)       // zones with a backing store commit and purge memory in chunks of 2 ^ 9 blocks = 2MB
+
+// states of a chunk of a zone with a backing store
+#define BUDDY_CHUNK_RESERVED (0)    // address range is reserved, memory is not accessible yet
+#define BUDDY_CHUNK_CLEAN (1)       // memory is accessible and holds no data handed out since last purge
+#define BUDDY_CHUNK_DIRTY (2)       // some of the memory is handed out
+#define BUDDY_CHUNK_IDLE (3)        // chunk is free, but some of its memory was handed out since commit or last purge
+#define BUDDY_IDLE_MAX (64)         // idle chunks of a zone are purged when there are more of them than this
 
 #ifndef POINTER_TYPES_DEFINITIONS_
 #define POINTER_TYPES_DEFINITIONS_
@@ -25,28 +39,98 @@ typedef struct {
 #define MEM_NODE_TYPE_DEFINITION_
 typedef struct mem_node {
 	struct mem_node* next;
+	struct mem_node* prev;
 }mem_node_t;
 #endif
 
 
+// descriptor of one block, records which cache and slab own the block
+// kept as void* so buddy allocator does not depend on slab types
+typedef struct page_desc {
+	void* cache;                           //owning kmem_cache_t or NULL
+	void* slab;                            //owning kmem_slab_t or NULL
+	signed char free_order;                //order of free block starting at this block, -1 if none starts here
+	signed char large_order;               //order of large kmalloc buffer starting at this block, -1 if none starts here
+	signed char chunk_state;               //BUDDY_CHUNK_* state of chunk, kept only in first block of every chunk
+}page_desc_t;
+
+// source of memory that is reserved up front but made usable only when needed
+// zones without a backing store get fully committed memory from the caller
+typedef struct buddy_backing {
+	int (*commit)(void* addr, size_t size); //makes reserved range accessible, returns 0 on success
+	void (*purge)(void* addr, size_t size); //gives physical memory of range back to the system, range stays accessible
+}buddy_backing_t;
+
+// per-thread lists of free blocks of small orders, filled from and spilled to buddies[] in batches
+// blocks in these lists are allocated from the point of view of buddies[], so they are never merged
+typedef struct buddy_pcp {
+	spinlock_t lock;                       //taken by threads using this slot, practically uncontended
+	mem_node_t* blocks[BUDDY_PCP_ORDERS];  //singly linked lists of free blocks, most recently freed first
+	int count[BUDDY_PCP_ORDERS];           //number of blocks in each list
+	char pad[64 - sizeof(spinlock_t) - BUDDY_PCP_ORDERS * (sizeof(mem_node_t*) + sizeof(int))]; //keep slots on separate cache lines
+}buddy_pcp_t;
 
+// every zone is an independent buddy allocator over one contiguous region of memory
 typedef struct buddy_header {
 
+	int node;                              //numa node of zone memory, threads on this node prefer this zone
+	int index;                             //index of zone in b_zones[]
+
 	block_ptr_t mem_start;                 //start addres of memory for allocation
 	ptr_t header_start;                    //start addres of buddy header     
 	ptr_t header_end;					   //end address of buddy header
 	int block_num;                         //total number of blocks for allocation
+	page_desc_t* pages;                    //descriptor for every block, indexed by (addr - mem_start) >> BLOCK_BIT_NUM
+	const buddy_backing_t* backing;        //backing store of zone memory, NULL if memory is fully committed
+	long idle_chunks;                      //number of chunks in BUDDY_CHUNK_IDLE state
 
 	mem_node_t* buddies[BUDDY_SIZE];       //array of heads of free block lists
-	HANDLE buddy_mutex;
+	unsigned free_orders;                  //bit i is set when buddies[i] is not empty
+	long free_blocks;                      //number of blocks in buddies[] lists
+	mutex_t buddy_mutex;                   //lock for buddies[] lists
+
+	buddy_pcp_t pcp[BUDDY_PCP_NUM];        //per-thread lists of free order 0 and 1 blocks
 
 }buddy_header_t;
 
-extern buddy_header_t* b_header;                    //global buddy allocator header
+extern buddy_header_t* volatile b_zones[BUDDY_ZONE_MAX]; //all registered zones
+extern volatile long b_zone_num;                    //number of registered zones, published after zone slot is filled
 
-void b_init(void* memstart, int blocknum);          //initialization of buddy allocator from memstart address with blocknum blocks
-void * b_alloc(int block_num);                      //allocation of block_num blocks of memory
-void b_free(void* addr, int block_num);             //deallocation of block_num blocks of memory starting from addr
-static void b_merge(int buddy_index);               //utility function for deallocation
-void b_print_state();                               //prints current state of buddies[] array
+static inline int b_zone_count() {
+	// number of zones that are fully initialized and can be used, read once per walk over b_zones[]
+	return (int)atomic_load_acquire(&b_zone_num);
+}
 
+void b_init(void* memstart, int blocknum);          //initialization of buddy allocator from memstart address with blocknum blocks as the only zone
+int b_init_backed(void* memstart, int blocknum, const buddy_backing_t* backing); //same as b_init, memory from memstart is only reserved and committed trough backing, returns 0 on success
+buddy_header_t* b_add_zone(void* memstart, int blocknum, int node, const buddy_backing_t* backing); //registers blocknum blocks from memstart as one more zone, local to numa node
+void * b_alloc(int block_num);                      //allocation of block_num blocks of memory, from zone of calling thread first, then from next zones in order
+void b_free(void* addr, int block_num);             //deallocation of block_num blocks of memory starting from addr, to the zone that contains addr
+void b_drain_cache();                               //returns blocks from all per-thread lists of all zones to buddies[]
+int b_thread_zone();                                //index of zone preferred by calling thread
+void b_set_thread_zone(int zone);                   //binds calling thread to zone with given index
+static void* b_zone_alloc(buddy_header_t* zone, int buddy_index); //allocation of one block of given order from one zone
+static void b_drain_zone(buddy_header_t* zone);     //returns blocks from all per-thread lists of zone to buddies[]
+static void* b_alloc_locked(buddy_header_t* zone, int buddy_index); //takes one block of given order from buddies[], buddy mutex must be held
+static int b_split(buddy_header_t* zone, int buddy_index); //splits first larger free block until buddies[buddy_index] is not empty, returns 0 if there is none
+static void b_free_locked(buddy_header_t* zone, void* addr, int buddy_index); //returns one block of given order to buddies[], buddy mutex must be held
+static void* b_pcp_alloc(buddy_header_t* zone, int buddy_index); //takes one block from per-thread list, refills it from buddies[] if empty
+static void b_pcp_free(buddy_header_t* zone, void* addr, int buddy_index); //puts one block to per-thread list, spills cold blocks to buddies[] above high watermark
+static int b_merge(buddy_header_t* zone, int buddy_index); //utility function for deallocation, returns order of resulting free block
+static void b_push(buddy_header_t* zone, int buddy_index, mem_node_t* node); //adds free block to buddies[buddy_index]
+static mem_node_t* b_pop(buddy_header_t* zone, int buddy_index); //takes first free block from buddies[buddy_index]
+static void b_remove(buddy_header_t* zone, int buddy_index, mem_node_t* node); //unlinks free block from buddies[buddy_index]
+static int b_chunk_commit(buddy_header_t* zone, uintptr_t chunk); //commits chunk with given number if it is only reserved, returns 1 on success
+static int b_commit(buddy_header_t* zone, void* addr, int buddy_index); //commits chunks of block that is being handed out and marks them dirty, returns 1 on success
+static void b_mark_idle(buddy_header_t* zone, void* addr, int buddy_index); //marks dirty chunks that became free after freeing block at addr as idle
+static void b_purge_zone(buddy_header_t* zone); //gives memory of idle chunks of zone back to backing store, buddy mutex must be held
+static uintptr_t b_block_index(buddy_header_t* zone, const void* addr); //number of block inside of zone that contains addr
+void b_purge();                                     //gives memory of idle chunks of all zones back to their backing stores
+long b_free_blocks();                               //number of free blocks in all zones, including per-thread lists
+long b_total_blocks();                              //number of blocks for allocation in all zones
+int b_check_consistency();                          //validates lists of all zones, prints problems and returns their number
+void b_print_state();                               //prints current state of buddies[] array of every zone
+buddy_header_t* b_zone_of(const void* addr);        //zone that contains addr, NULL if addr is outside of all zones
+page_desc_t* b_page_desc(const void* addr);         //descriptor of block containing addr, NULL if addr is outside of memory
+void* b_block_start(const void* addr);              //start of block containing addr, NULL if addr is outside of memory
+void b_set_owner(void* addr, int block_num, void* cache, void* slab); //records owner for block_num blocks starting from addr
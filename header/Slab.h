@@ -1,23 +1,44 @@
 #pragma once
 #include <stdlib.h>
-#include <Windows.h>
-#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "Sync.h"
 
 #define BLOCK_SIZE (4096)
-#define CACHE_L1_LINE_SIZE (64)
+#define CACHE_L1_LINE_SIZE (64)         // line size used for padding and when real one can not be detected
 #define CACHE_NAME_SIZE (64)
-#define SMALL_BUFFER_NUM (18)            // size of small buffers array
 #define	SMALL_BUFFER_LOWER_LIMIT (5)     // min size of small buffer is 2^5
 #define	SMALL_BUFFER_UPPER_LIMIT (17)    // max size of small buffer is 2^17
-#define BITS_PER_BYTE (8)
+#ifndef SMALL_BUFFER_CLASS_BITS
+#define SMALL_BUFFER_CLASS_BITS (2)      // every power of 2 band is split into 2^bits size classes (0 - 2)
+#endif
+#define SMALL_BUFFER_NUM (1 + ((SMALL_BUFFER_UPPER_LIMIT - SMALL_BUFFER_LOWER_LIMIT) << SMALL_BUFFER_CLASS_BITS)) // size of small buffers array
+#define SMALL_BUFFER_TABLE_MAX (1024)    // sizes up to this one are mapped to class trough lookup table
+#define SMALL_BUFFER_TABLE_SHIFT (3)     // table has one entry for every 2^3 bytes
+#define SLAB_WASTE_SHIFT (3)             // slab is grown until unused space is below 1/2^3 of slab size
+#define SLAB_BLOCKS_MAX (64)             // slab is not grown above this number of blocks to reduce waste
+#define OFF_SLAB_MIN_SIZE (512)          // caches of objects at least this big may keep slab descriptors outside of slab
+#define OFF_SLAB_MAP_SIZE (((SLAB_BLOCKS_MAX * BLOCK_SIZE / OFF_SLAB_MIN_SIZE) + 63) / 64 * 8) // space for one map in off-slab descriptor
+#define KMEM_CPU_NUM (16)                // number of per-thread magazine slots in each cache
+#define MAGAZINE_SIZE_MAX (64)           // max number of objects in one magazine
+#define KMEM_RECLAIM_RESERVE (1)         // default number of empty slabs every cache keeps when reclaimer shrinks it
+#define KMEM_RECLAIM_INTERVAL_MS (100)   // default period of reclaimer checks of free memory
+#define KMEM_COLOR_LEVELS (2)            // slabs can be colored at L1 or L2 set granularity
+#define KMEM_COLOR_DEFAULT (1)           // level at which new caches color their slabs, 0 disables coloring
+#define KMEM_REGISTRY_SIZE (1024)        // slots in hashed index of caches by name, must be power of 2
+#define OBJ_ALIGN (sizeof(void*))       // alignment of slots inside a slab
+#define OBJ_ALIGN_UP(x) (((x) + OBJ_ALIGN - 1) & ~(OBJ_ALIGN - 1))
 
 #define OBJ_NOT_FOUND      (96543)
 #define OBJ_FOUND_FULL     (96542)
 #define OBJ_FOUND_PARTIAL  (96541)
 
-#define SLOT_FOUND_PARTIAL (87654)
-#define SLOT_FOUND_EMPTY   (87653)
-#define SLOT_NOT_FOUND     (87652)
+#define SLAB_PARTIAL_BUCKETS (8)         // partial slabs are kept in this many lists by fullness
+#define SLAB_PICK_TRIES (4)              // slabs allocation tries to lock before it waits for the fullest one
+
+#define SLAB_EMPTY   (0)                  // ids of cache lists, kept in every slab
+#define SLAB_PARTIAL (1)                  // first partial list, list SLAB_PARTIAL + b holds slabs with inuse * SLAB_PARTIAL_BUCKETS / objects_per_slab == b
+#define SLAB_FULL    (SLAB_PARTIAL + SLAB_PARTIAL_BUCKETS)
 
 #define ALLOCATION_ERROR (1)
 #define DEALLOCATION_ERROR (2)
@@ -35,24 +56,66 @@ typedef struct {
 
 #endif
 
-typedef char octet;
+// free slots map is an array of 64 bit words, bit i of word w is slot w * 64 + i (1 = used)
+// every slab has two maps of the same size: free slots map and remote free map right after it
+typedef uint64_t map_word_t;
+#define MAP_WORD_BITS (64)
+#define MAP_WORD_FULL (~(map_word_t)0)
 
+// slab lock protects free map, free_hint and constructed
+// inuse, list and list links are protected by list lock of cache, inuse counts slots reserved for allocation before they are taken
 typedef struct kmem_slab {
 
-	unsigned L1_offset;              // L1 offset for current slab
+	void* mem_start;                 // first block of slab memory, same as slab address when descriptor is on slab
+	unsigned color_offset;           // offset of first slot from start of object area, slabs with different offsets use different cache sets
 	void* obj_start_addr;            // starting address of first slot 
-	octet* free_slots_map;			 // pointer to bit map of free slots
+	spinlock_t lock;                 // taken while slots are taken or freed, list lock may be held when it is taken but not the other way around
+	map_word_t* free_slots_map;		 // pointer to bit map of free slots
+	volatile map_word_t* remote_free_map; // slots freed without list lock (1 = freed), merged into free map by list lock holder
+	volatile long remote_pending;    // 1 while slab is in remote list of its cache
+	volatile long remote_writers;    // threads that are marking objects of this slab in remote free map, slab is not released while it is raised
+	struct kmem_slab* remote_next;   // next slab in remote list of cache
+	unsigned inuse;                  // number of used and reserved slots
+	unsigned free_hint;              // no free slot exists in map words before this one
+	unsigned constructed;            // slots below this one were handed out or constructed when slab was added, others are constructed on first hand-out
+	int list;                        // SLAB_EMPTY, one of partial lists or SLAB_FULL list that holds the slab
+
+	int in_batch;                    // 1 while slab is in list of slabs touched by a bulk free
+	struct kmem_slab* batch_next;    // next slab touched by a bulk free
 
 	struct kmem_slab* next;          // pointer to next slab inside of cache
+	struct kmem_slab* prev;          // pointer to previous slab inside of cache
 	
 }kmem_slab_t;
 
+typedef struct kmem_magazine {
+
+	unsigned rounds;                      // number of objects in magazine
+	void* objs[MAGAZINE_SIZE_MAX];        // stack of free objects
+
+	struct kmem_magazine* next;           // pointer to next magazine in depot
+
+}kmem_magazine_t;
+
+typedef struct kmem_cpu_cache {
+
+	spinlock_t lock;                      // taken by threads using this slot, practically uncontended
+	kmem_magazine_t* loaded;              // magazine used for alloc and free
+	kmem_magazine_t* previous;            // full or empty magazine kept for exchange with loaded
+
+	unsigned long allocs;                 // objects allocated from magazines of this slot, counted under lock
+	unsigned long frees;                  // objects freed to magazines of this slot, counted under lock
+
+	char pad[CACHE_L1_LINE_SIZE - 3 * sizeof(void*) - 2 * sizeof(unsigned long)]; // keep slots on separate cache lines
+
+}kmem_cpu_cache_t;
+
 typedef struct kmem_cache_s {
 
 	char name[CACHE_NAME_SIZE];
 
 	kmem_slab_t* slabs_empty;        // list of empty slabs
-	kmem_slab_t* slabs_partial;      // list of partially full slabs
+	kmem_slab_t* slabs_partial[SLAB_PARTIAL_BUCKETS]; // lists of partially full slabs, from least to most full
 	kmem_slab_t* slabs_full;         // list of full slabs
 
 	unsigned object_count;           // total number of objects in all slabs
@@ -61,62 +124,220 @@ typedef struct kmem_cache_s {
 	size_t free_map_size;			 // size of free slot bit map in each slab
 	size_t unused_space;             // remainder from last object to end of slab
 	size_t obj_size;                 // size of contained objects in bytes
+	unsigned slab_blocks;            // number of blocks in each slab
+	int off_slab;                    // 1 if slab descriptors and free maps are allocated from slab-desc cache
 	int recently_added;				 // 1 if added after last shrink attempt
 
-	int next_L1_offset;				 // offset for next slab that will be added		
+	int color_level;                 // hardware cache level whose sets slabs are spread over, 0 if coloring is disabled
+	unsigned color_align;            // distance between two colors, line size of colored cache level
+	unsigned colors;                 // number of different offsets, limited by unused space and cache way size
+	unsigned color_next;             // color of next slab that will be added
 
 	void (*ctor)(void*);             // constructor called for contained objects
 	void (*dtor)(void*);             // destructor called for contained objects
+	int lazy_ctor;                   // 1 if slots are constructed on first hand-out instead of when slab is added
 
 	struct kmem_cache_s* next;       // pointer to next cache in list of caches
 
-	HANDLE cache_mutex;              // handle to mutex for synchronization on this cache
+	mutex_t cache_mutex;             // serializes growth, release of slabs and checks, allocation and free paths only take it to grow the cache
+	spinlock_t list_lock;            // protects slab lists, inuse of slabs and counters, held only for short list operations
+
+	unsigned magazine_size;          // objects per magazine, 0 disables magazine layer
+	kmem_cpu_cache_t cpu_caches[KMEM_CPU_NUM]; // per-thread magazines
+	spinlock_t depot_lock;           // lock for depot lists
+	kmem_magazine_t* depot_full;     // depot of full magazines
+	kmem_magazine_t* depot_empty;    // depot of empty magazines
+
+	kmem_slab_t* volatile remote_slabs; // lock-free stack of slabs with remote frees, emptied by list lock holder
+	volatile long remote_frees;      // objects freed trough remote free maps, counted atomically
+	volatile long remote_user_frees; // part of remote_frees that came from the user
+
+	unsigned long allocs;            // objects allocated bypassing magazines, counted under list lock
+	unsigned long frees;             // objects freed bypassing magazines, counted under list lock
+	unsigned long last_grow;         // value of global grow clock when cache was last extended, reclaimer shrinks oldest first
+	unsigned empty_reserve;          // number of empty slabs reclaimer leaves in cache
+	unsigned long reclaim_pass;      // last reclaimer pass that visited this cache
+
+	unsigned long grows;             // number of slabs added to cache
+	unsigned long reclaims;          // number of slabs returned to buddy allocator
+	unsigned long contention;        // number of times list lock was found taken by allocation
+	unsigned high_water;             // max number of objects taken from slabs at once
 
 	int error_code;
 
 }kmem_cache_t;
 
+// snapshot of cache state and counters, filled by kmem_cache_stats
+typedef struct kmem_cache_stats {
+
+	char name[CACHE_NAME_SIZE];
+	size_t obj_size;                 // size of objects in bytes
+	unsigned objects_per_slab;       // number of slots in each slab
+	unsigned slab_blocks;            // number of blocks in each slab
+	unsigned slab_count;             // number of slabs
+	unsigned total_objs;             // number of slots in all slabs
+	unsigned active_objs;            // objects taken from slabs (in use or cached in magazines)
+	unsigned high_water;             // max value of active_objs
+	unsigned long allocs;            // objects allocated trough kmem_cache_alloc, kmem_cache_alloc_bulk and kmalloc
+	unsigned long frees;             // objects freed trough kmem_cache_free, kmem_cache_free_bulk and kfree
+	unsigned long grows;             // slabs added
+	unsigned long reclaims;          // slabs returned to buddy allocator
+	unsigned long contention;        // times list lock was found taken by allocation
+	size_t wasted_bytes;             // unused space at the end of all slabs
+	unsigned magazine_size;          // objects per magazine, 0 if magazines are disabled
+	unsigned colors;                 // number of different offsets of first slot in slabs
+	unsigned long remote_frees;      // objects freed trough remote free maps while list lock was held by other thread
+	unsigned empty_slabs;            // slabs with no used slots, returned by kmem_cache_shrink
+	unsigned partial_slabs;          // slabs with both used and free slots
+	unsigned partial_free_objs;      // free slots in partial slabs, memory that can not be returned until their slabs go empty
+
+}kmem_cache_stats_t;
+
+
+// geometry of one level of hardware data cache, detected in kmem_init
+typedef struct kmem_hw_cache {
+	unsigned line_size;              // bytes in one cache line
+	unsigned way_size;               // bytes covered by one way (number of sets * line size), offsets past it map to the same sets again
+}kmem_hw_cache_t;
+
+// number of lock-free registry readers on one per-thread slot, padded to its own cache line
+// readers count in the half picked by registry epoch, so destroy waits only for readers of the old half
+typedef struct kmem_reader {
+	volatile long count[2];
+	char pad[CACHE_L1_LINE_SIZE - 2 * sizeof(long)];
+}kmem_reader_t;
+
+// registry slot that held a destroyed cache, probing continues past it
+#define REGISTRY_TOMBSTONE ((kmem_cache_t*)1)
 
 typedef struct kmem_header {
 
 	kmem_cache_t cache_of_caches;   // cache for all other caches
 
-	kmem_cache_t small_buffer_caches[SMALL_BUFFER_NUM]; // array of small buffer caches (2^5 - 2^17 size)
+	kmem_cache_t small_buffer_caches[SMALL_BUFFER_NUM]; // array of small buffer caches (2^5 - 2^17 size), one per size class
+
+	unsigned char small_buffer_table[(SMALL_BUFFER_TABLE_MAX >> SMALL_BUFFER_TABLE_SHIFT) + 1]; // size class of every size up to SMALL_BUFFER_TABLE_MAX
 
-	ptr_t header_end; // used to keep track of next free address inside 1st block
+	kmem_cache_t magazine_cache;    // cache for magazines of all other caches
+
+	kmem_cache_t slab_desc_cache;   // cache for descriptors of off-slab caches
+
+	ptr_t header_end; // used to keep track of next free address inside header blocks
 
 	kmem_cache_t* cache_head; // head of list of all caches
 
-	HANDLE cache_list_mutex; // mutex for synchronization on list of all caches
+	mutex_t cache_list_mutex; // mutex for synchronization on list of all caches and registry writers
+
+	kmem_cache_t* volatile registry[KMEM_REGISTRY_SIZE]; // open addressing index of caches by name, read without locks
+
+	volatile long registry_seq; // odd while registry is rebuilt, changes after every rebuild
+
+	unsigned registry_used; // slots in registry that hold a cache
+
+	unsigned registry_tombstones; // tombstone slots in registry, it is rebuilt when they pass quarter of it
+
+	volatile long registry_overflow; // caches that did not fit in full registry and are only in list of caches
+
+	kmem_reader_t registry_readers[KMEM_CPU_NUM]; // lock-free readers in progress, destroy waits for them before cache memory is reused
+
+	volatile long registry_epoch; // low bit picks half of reader counts new readers use, flipped at start of every grace period
+
+	mutex_t registry_gp_mutex; // one grace period runs at a time
+
+	kmem_hw_cache_t hw_caches[KMEM_COLOR_LEVELS]; // L1 and L2 data cache geometry used for slab coloring
+
+	volatile long grow_clock;       // incremented on every slab grow, orders caches by last growth
+	kthread_t reclaim_thread;       // background reclaimer, runs while reclaim_running is 1
+	volatile long reclaim_running;
+	long reclaim_low;               // reclaimer starts shrinking caches when free blocks drop below this
+	long reclaim_high;              // and stops when free blocks are above this
+	unsigned reclaim_interval;      // period of free memory checks in ms
+	unsigned long reclaim_passes;   // number of reclaimer passes that shrank caches
 
 }kmem_header_t;
 
 static kmem_header_t* kmem_header;   //global kmem_header
 
-static unsigned calculate_slab_blocks(size_t obj_size);
-static void calculate_slab_areas(size_t obj_size, size_t* map_size_p, unsigned* num_of_obj_p, size_t* unused_space_p);
+static unsigned calculate_slab_blocks(size_t obj_size, int off_slab);
+static void calculate_slab_areas(size_t obj_size, unsigned slab_blocks, int off_slab, size_t* map_size_p, unsigned* num_of_obj_p, size_t* unused_space_p);
+static unsigned small_buffer_class(size_t size);
 static unsigned total_cache_blocks(kmem_cache_t* cachep);
 static void init_cache(kmem_cache_t* new_cache, const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*));
-static void move_partial_full(kmem_cache_t* cache);
-static void move_empty_partial(kmem_cache_t* cache);
-static void move_full_partial(kmem_cache_t* cache, kmem_slab_t* slab);
-static void move_partial_empty(kmem_cache_t* cache, kmem_slab_t* slab);
-static int slab_empty(kmem_cache_t* cache, kmem_slab_t* slab);
-static int partial_slab_full(kmem_cache_t* cache);
-static int get_free_slot(kmem_cache_t* parent_cache, void** address);
-static int find_containing_slab(kmem_cache_t* cachep, void* objp, kmem_slab_t** res);
+static void cache_discard(kmem_cache_t* cachep);
+static void slab_list_remove(kmem_slab_t** list, kmem_slab_t* slab);
+static void slab_list_add(kmem_slab_t** list, kmem_slab_t* slab);
+static kmem_slab_t** slab_list_head(kmem_cache_t* cache, int list);
+static int slab_list_id(kmem_cache_t* cache, unsigned inuse);
+static kmem_slab_t* slab_fullest_partial(kmem_cache_t* cache);
+static kmem_slab_t* slab_pick(kmem_cache_t* cache);
+static void slab_relink(kmem_cache_t* cache, kmem_slab_t* slab);
+static void slab_construct(kmem_cache_t* cache, kmem_slab_t* slab, unsigned first, unsigned end);
+static void slab_destruct(kmem_cache_t* cache, kmem_slab_t* slab);
+static unsigned slab_take_slots(kmem_cache_t* cache, kmem_slab_t* slab, unsigned n, void** objs, unsigned* construct_from);
+static int find_containing_slab(kmem_cache_t* cachep, void* objp, kmem_slab_t** res, unsigned* slot);
 static int extend_cache(kmem_cache_t* cache);
+static int cache_grow(kmem_cache_t* cachep);
+static unsigned slab_free(kmem_cache_t* cachep, unsigned n, void** objs);
+static int cache_lock(kmem_cache_t* cachep);
+static void cache_unlock(kmem_cache_t* cachep);
+static void slab_lists_lock(kmem_cache_t* cachep);
+static void slab_lists_unlock(kmem_cache_t* cachep);
+static unsigned slab_alloc_locked(kmem_cache_t* cachep, unsigned n, void** objs, int count);
+static void slab_free_locked(kmem_cache_t* cachep, unsigned n, void** objs, int count);
+static void slab_free_remote(kmem_cache_t* cachep, unsigned n, void** objs, int count);
+static void slab_drain_remote(kmem_cache_t* cachep);
+static void* kmalloc_large(size_t size);
+static void kfree_large(const void* objp);
+static unsigned magazine_default_size(size_t obj_size);
+static int magazine_setup(kmem_cpu_cache_t* cpu);
+static void* magazine_alloc(kmem_cache_t* cachep);
+static int magazine_holds(kmem_magazine_t* mag, void* objp);
+static int magazine_free(kmem_cache_t* cachep, void* objp);
+static void magazine_flush(kmem_cache_t* cachep);
+static unsigned registry_hash(const char* name);
+static kmem_cache_t* registry_lookup(const char* name);
+static int registry_insert(kmem_cache_t* cachep);
+static int registry_remove(kmem_cache_t* cachep);
+static void registry_rebuild();
+static void registry_wait_readers();
+static int slabs_release(kmem_cache_t* cachep, unsigned keep);
+static void slabs_destroy(kmem_cache_t* cachep);
+static int cache_reclaim(kmem_cache_t* cachep);
+static void reclaim_pass();
+static KTHREAD_RETURN reclaim_main(void* arg);
+static int cache_check(kmem_cache_t* cachep);
+static int cache_check_magazine(kmem_cache_t* cachep, kmem_magazine_t* mag, unsigned* objects);
+static void detect_hw_cache(int level, kmem_hw_cache_t* hw);
+static void cache_color_setup(kmem_cache_t* cachep, int level);
+static void kmem_setup(); //creates kmem header and internal caches once buddy allocator is initialized
+static kmem_cache_t* cache_lookup_locked(const char* name);
+static void cache_register(kmem_cache_t* cachep);
+static int cache_unregister(kmem_cache_t* cachep);
  kmem_cache_t* find_cache(const char* name);
  void print_list_of_caches();
 
 
 void kmem_init(void* space, int block_num); //Initialization
+void* kmem_init_arena(size_t size, int flags); //Initialization over reserved arena of size bytes committed on demand, flags are ARENA_* from Arena.h, returns arena start or NULL
+void kmem_add_zone(void* space, int block_num, int node); //Adds memory local to numa node, threads on that node allocate from it first
 kmem_cache_t* kmem_cache_create(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*)); // Allocate cache
 int kmem_cache_shrink(kmem_cache_t* cachep); // Shrink cache
 void* kmem_cache_alloc(kmem_cache_t* cachep); // Allocate one object from cache
 void kmem_cache_free(kmem_cache_t* cachep, void* objp); // Deallocate one object from cache
-void* kmalloc(size_t size); // Alloacate one small memory buffer
-void kfree(const void* objp); // Deallocate one small memory buffer
+unsigned kmem_cache_alloc_bulk(kmem_cache_t* cachep, unsigned n, void** objs); // Allocate up to n objects under one lock, returns number allocated
+void kmem_cache_free_bulk(kmem_cache_t* cachep, unsigned n, void** objs); // Deallocate n objects under one lock
+void* kmalloc(size_t size); // Alloacate one memory buffer, sizes above 2^SMALL_BUFFER_UPPER_LIMIT are taken directly from buddy allocator
+void kfree(const void* objp); // Deallocate one memory buffer
+size_t small_buffer_class_size(unsigned index); // Size in bytes of small buffer class, index is below SMALL_BUFFER_NUM
 void kmem_cache_destroy(kmem_cache_t* cachep); // Deallocate cache
 void kmem_cache_info(kmem_cache_t* cachep); // Print cache info
-int kmem_cache_error(kmem_cache_t* cachep); // Print error message
\ No newline at end of file
+void kmem_cache_stats(kmem_cache_t* cachep, kmem_cache_stats_t* stats); // Fill snapshot of cache counters
+void kmem_slabinfo(FILE* out); // Print one line of counters for every cache, in /proc/slabinfo style
+int kmem_check_consistency(); // Validate buddy lists and all caches, print problems and return their number
+int kmem_cache_error(kmem_cache_t* cachep); // Print error message
+int kmem_cache_set_magazine_size(kmem_cache_t* cachep, unsigned size); // Set objects per magazine, 0 disables magazines
+void kmem_cache_set_reserve(kmem_cache_t* cachep, unsigned slabs); // Set number of empty slabs background reclaimer keeps in cache
+int kmem_cache_set_lazy_ctor(kmem_cache_t* cachep, int lazy); // Construct objects on first allocation (1) or when slab is added (0, default)
+int kmem_cache_set_coloring(kmem_cache_t* cachep, int level); // Color new slabs at L1 (1) or L2 (2) set granularity, 0 disables coloring
+int kmem_reclaim_start(long low_blocks, long high_blocks, unsigned interval_ms); // Start background reclaimer, 0 for defaults
+void kmem_reclaim_stop(); // Stop background reclaimer and wait for it
\ No newline at end of file
@@ -0,0 +1,304 @@
+#pragma once
+
+// locking layer used by buddy allocator and slab allocator
+//
+// mutex_t backend is selected at compile time by defining one of:
+//   KMEM_LOCK_PTHREAD - pthread mutex (futex on linux, no syscall when uncontended)
+//   KMEM_LOCK_WIN32   - slim reader/writer lock (no kernel object when uncontended)
+//   KMEM_LOCK_SPIN    - spinlock, for builds where every critical section is short
+// if none is defined pthread is used on posix systems and win32 on windows
+//
+// spinlock_t is always available for short critical sections
+// kthread_t is a minimal thread wrapper for allocator's own background threads
+
+#if !defined(KMEM_LOCK_PTHREAD) && !defined(KMEM_LOCK_WIN32) && !defined(KMEM_LOCK_SPIN)
+#ifdef _WIN32
+#define KMEM_LOCK_WIN32
+#else
+#define KMEM_LOCK_PTHREAD
+#endif
+#endif
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <intrin.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+//***************************************atomics**************************************
+
+static inline long atomic_inc(volatile long* value) {
+	// returns incremented value
+#ifdef _MSC_VER
+	return _InterlockedIncrement(value);
+#else
+	return __atomic_add_fetch(value, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void atomic_add_full(volatile long* value, long n) {
+	// sequentially consistent add, orders all memory accesses around it
+#ifdef _MSC_VER
+	_InterlockedExchangeAdd(value, n);
+#else
+	__atomic_add_fetch(value, n, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline long atomic_load_full(volatile long* value) {
+#ifdef _MSC_VER
+	return _InterlockedOr(value, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline long atomic_load_acquire(volatile long* value) {
+	// acquire load, accesses after it are not moved before it, pairs with atomic_store_release
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	long v = *value;
+	_ReadWriteBarrier();
+	return v;
+#elif defined(_MSC_VER)
+	return _InterlockedOr(value, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void atomic_store_release(volatile long* value, long n) {
+	// release store, everything written before it is visible to threads that acquire load the value
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	_ReadWriteBarrier();
+	*value = n;
+#elif defined(_MSC_VER)
+	_InterlockedExchange(value, n);
+#else
+	__atomic_store_n(value, n, __ATOMIC_RELEASE);
+#endif
+}
+
+static inline void* atomic_load_ptr(void* volatile* p) {
+	// sequentially consistent pointer load, pairs with atomic_store_ptr
+#ifdef _MSC_VER
+	return _InterlockedCompareExchangePointer(p, NULL, NULL);
+#else
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void atomic_store_ptr(void* volatile* p, void* value) {
+	// sequentially consistent pointer store, everything written before it is visible to readers of the pointer
+#ifdef _MSC_VER
+	_InterlockedExchangePointer(p, value);
+#else
+	__atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline long atomic_xchg(volatile long* value, long n) {
+	// sequentially consistent exchange, returns old value
+#ifdef _MSC_VER
+	return _InterlockedExchange(value, n);
+#else
+	return __atomic_exchange_n(value, n, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint64_t atomic_or64(volatile uint64_t* value, uint64_t bits) {
+	// sequentially consistent or, returns old value
+#ifdef _MSC_VER
+	return (uint64_t)_InterlockedOr64((volatile __int64*)value, (__int64)bits);
+#else
+	return __atomic_fetch_or(value, bits, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint64_t atomic_xchg64(volatile uint64_t* value, uint64_t n) {
+	// sequentially consistent exchange, returns old value
+#ifdef _MSC_VER
+	return (uint64_t)_InterlockedExchange64((volatile __int64*)value, (__int64)n);
+#else
+	return __atomic_exchange_n(value, n, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void* atomic_xchg_ptr(void* volatile* p, void* value) {
+	// sequentially consistent pointer exchange, returns old value
+#ifdef _MSC_VER
+	return _InterlockedExchangePointer(p, value);
+#else
+	return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline int atomic_cas_ptr(void* volatile* p, void* expected, void* value) {
+	// sequentially consistent compare and swap, returns 1 if *p was expected and is now value
+#ifdef _MSC_VER
+	return _InterlockedCompareExchangePointer(p, value, expected) == expected;
+#else
+	return __atomic_compare_exchange_n(p, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline unsigned thread_slot(void) {
+	// small per-thread number, assigned round robin on first call from each thread
+	// used to pick per-thread structures without a syscall
+	static volatile long next_slot = 0;
+	static THREAD_LOCAL unsigned slot = 0;
+	if (slot == 0) {
+		slot = (unsigned)atomic_inc(&next_slot);
+	}
+	return slot - 1;
+}
+
+//**************************************spinlock**************************************
+
+typedef volatile long spinlock_t;
+
+#define SPINLOCK_INIT (0)
+#define SPIN_YIELD_LIMIT (256)  // spins on a taken lock before waiting thread gives up its time slice
+
+static inline void cpu_relax(void) {
+#if defined(_MSC_VER)
+	YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline void cpu_yield(void) {
+	// lets holder of a lock run when there are more threads than cores
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static inline void spin_init(spinlock_t* lock) {
+	*lock = 0;
+}
+
+static inline int spin_trylock(spinlock_t* lock) {
+	// returns 1 if lock is taken
+#ifdef _MSC_VER
+	return _InterlockedExchange(lock, 1) == 0;
+#else
+	return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+#endif
+}
+
+static inline int spin_is_locked(spinlock_t* lock) {
+#ifdef _MSC_VER
+	return *lock != 0;
+#else
+	return __atomic_load_n(lock, __ATOMIC_RELAXED) != 0;
+#endif
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+	// test and test-and-set: spin on plain reads so the cache line is not bounced while lock is held
+	// holder that was preempted is given the core after SPIN_YIELD_LIMIT spins
+	unsigned spins = 0;
+	while (!spin_trylock(lock)) {
+		while (spin_is_locked(lock)) {
+			if (++spins < SPIN_YIELD_LIMIT) {
+				cpu_relax();
+			}
+			else {
+				cpu_yield();
+				spins = 0;
+			}
+		}
+	}
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+#ifdef _MSC_VER
+	_InterlockedExchange(lock, 0);
+#else
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+//***************************************mutex****************************************
+// all mutex functions return 0 on success
+
+#if defined(KMEM_LOCK_PTHREAD)
+
+typedef pthread_mutex_t mutex_t;
+
+static inline int mutex_init(mutex_t* m) { return pthread_mutex_init(m, NULL); }
+static inline int mutex_lock(mutex_t* m) { return pthread_mutex_lock(m); }
+static inline int mutex_trylock(mutex_t* m) { return pthread_mutex_trylock(m); }
+static inline int mutex_unlock(mutex_t* m) { return pthread_mutex_unlock(m); }
+static inline int mutex_destroy(mutex_t* m) { return pthread_mutex_destroy(m); }
+
+#elif defined(KMEM_LOCK_WIN32)
+
+typedef SRWLOCK mutex_t;
+
+static inline int mutex_init(mutex_t* m) { InitializeSRWLock(m); return 0; }
+static inline int mutex_lock(mutex_t* m) { AcquireSRWLockExclusive(m); return 0; }
+static inline int mutex_trylock(mutex_t* m) { return TryAcquireSRWLockExclusive(m) ? 0 : 1; }
+static inline int mutex_unlock(mutex_t* m) { ReleaseSRWLockExclusive(m); return 0; }
+static inline int mutex_destroy(mutex_t* m) { (void)m; return 0; }
+
+#elif defined(KMEM_LOCK_SPIN)
+
+typedef spinlock_t mutex_t;
+
+static inline int mutex_init(mutex_t* m) { spin_init(m); return 0; }
+static inline int mutex_lock(mutex_t* m) { spin_lock(m); return 0; }
+static inline int mutex_trylock(mutex_t* m) { return spin_trylock(m) ? 0 : 1; }
+static inline int mutex_unlock(mutex_t* m) { spin_unlock(m); return 0; }
+static inline int mutex_destroy(mutex_t* m) { (void)m; return 0; }
+
+#endif
+
+//**************************************threads***************************************
+// thread function is declared as: KTHREAD_RETURN name(void* arg), and returns KTHREAD_RETURN_VALUE
+
+#ifdef _WIN32
+
+typedef HANDLE kthread_t;
+#define KTHREAD_RETURN DWORD WINAPI
+#define KTHREAD_RETURN_VALUE (0)
+
+static inline int kthread_start(kthread_t* t, LPTHREAD_START_ROUTINE fn, void* arg) {
+	*t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+	return *t ? 0 : 1;
+}
+static inline void kthread_join(kthread_t t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+static inline void kthread_sleep_ms(unsigned ms) { Sleep(ms); }
+
+#else
+
+typedef pthread_t kthread_t;
+#define KTHREAD_RETURN void*
+#define KTHREAD_RETURN_VALUE (NULL)
+
+static inline int kthread_start(kthread_t* t, void* (*fn)(void*), void* arg) { return pthread_create(t, NULL, fn, arg); }
+static inline void kthread_join(kthread_t t) { pthread_join(t, NULL); }
+static inline void kthread_sleep_ms(unsigned ms) {
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+#endif
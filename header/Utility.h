@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// bit manipulation helpers built on compiler intrinsics
+// all of them are integer only, so hot paths never touch floating point math
+
+// 2 ^ n as a constant expression, usable in array sizes and #if
+#define POW2(n) ((size_t)1 << (n))
+
+// 1 if x is a power of 2, x must not be 0
+#define IS_POW2(x) (((x) & ((x) - 1)) == 0)
+
+static inline int bit_ctz32(uint32_t x) {
+	// index of lowest set bit, x must not be 0
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return (int)index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+static inline int bit_ctz64(uint64_t x) {
+	// index of lowest set bit, x must not be 0
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return (int)index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+static inline int bit_popcount64(uint64_t x) {
+	// number of set bits
+#ifdef _MSC_VER
+	return (int)__popcnt64(x);
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+static inline int bit_clz64(uint64_t x) {
+	// number of zero bits above highest set bit, x must not be 0
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - (int)index;
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+static inline int closest_lower_log2(size_t x) {
+	// floor(log2(x)), x must not be 0
+	return 63 - bit_clz64((uint64_t)x);
+}
+
+static inline int closest_higher_log2(size_t x) {
+	// ceil(log2(x)), 0 for x <= 1
+	return (x <= 1) ? 0 : 64 - bit_clz64((uint64_t)x - 1);
+}
+
+static inline size_t closest_higher_pow2(size_t x) {
+	// smallest power of 2 that is >= x, 1 for x <= 1
+	return POW2(closest_higher_log2(x));
+}
+
+static inline size_t div_round_up(size_t x, size_t y) {
+	// ceil(x / y) for y > 0, x + y - 1 is not formed so x near SIZE_MAX does not wrap
+	return x / y + (x % y != 0);
+}
@@ -0,0 +1,112 @@
+#include"Arena.h"
+#include"Utility.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+const buddy_backing_t arena_backing = { arena_commit, arena_purge };
+const buddy_backing_t arena_hugetlb_backing = { arena_hugetlb_commit, arena_hugetlb_purge };
+
+void* arena_reserve(size_t size, int flags, const buddy_backing_t** backing) {
+
+	// reservation is made of whole chunks
+	size = div_round_up(size, ARENA_CHUNK_SIZE) * ARENA_CHUNK_SIZE;
+	*backing = &arena_backing;
+
+#ifdef _WIN32
+	if (flags & (ARENA_HUGEPAGE | ARENA_HUGETLB)) {
+		printf("WARNING in arena_reserve: huge pages are not supported on windows, using normal pages\n");
+	}
+
+	// reservation is aligned to 64KB only, buddy header is padded to reach first chunk boundary
+	void* addr = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!addr) {
+		printf("ERROR in arena_reserve: could not reserve %zu bytes\n", size);
+		return NULL;
+	}
+	return addr;
+#else
+	if (flags & ARENA_HUGETLB) {
+#ifdef MAP_HUGETLB
+		// huge page mappings are mapped accessible, kernel fills in huge pages from the pool on first touch
+		// pages are reserved in the pool here (no MAP_NORESERVE), so a pool that is too small fails now instead of on first touch
+		void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			*backing = &arena_hugetlb_backing;
+			return addr;
+		}
+#endif
+		printf("WARNING in arena_reserve: huge pages are not available, using normal pages\n");
+	}
+
+	// one more chunk is reserved so start can be aligned to chunk size, extra memory is unmapped
+	ptr_t raw = (ptr_t)mmap(NULL, size + ARENA_CHUNK_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == (ptr_t)MAP_FAILED) {
+		printf("ERROR in arena_reserve: could not reserve %zu bytes\n", size);
+		return NULL;
+	}
+	ptr_t addr = (ptr_t)(((uintptr_t)raw + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+	if (addr != raw) {
+		munmap(raw, addr - raw);
+	}
+	if (raw + ARENA_CHUNK_SIZE != addr) {
+		munmap(addr + size, raw + ARENA_CHUNK_SIZE - addr);
+	}
+
+#ifdef MADV_HUGEPAGE
+	// committed chunks are aligned and as large as huge pages, so kernel can back each with one huge page
+	if ((flags & ARENA_HUGEPAGE) && madvise(addr, size, MADV_HUGEPAGE) != 0) {
+		printf("WARNING in arena_reserve: transparent huge pages are not available\n");
+	}
+#endif
+
+	return addr;
+#endif
+}
+
+void arena_release(void* addr, size_t size) {
+	if (!addr) {
+		return;
+	}
+#ifdef _WIN32
+	(void)size;
+	VirtualFree(addr, 0, MEM_RELEASE);
+#else
+	munmap(addr, div_round_up(size, ARENA_CHUNK_SIZE) * ARENA_CHUNK_SIZE);
+#endif
+}
+
+int arena_commit(void* addr, size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) ? 0 : 1;
+#else
+	return mprotect(addr, size, PROT_READ | PROT_WRITE);
+#endif
+}
+
+void arena_purge(void* addr, size_t size) {
+	// content of purged memory is lost, next touch gets a fresh page
+#ifdef _WIN32
+	VirtualAlloc(addr, size, MEM_RESET, PAGE_READWRITE);
+#else
+	madvise(addr, size, MADV_DONTNEED);
+#endif
+}
+
+int arena_hugetlb_commit(void* addr, size_t size) {
+	(void)addr;
+	(void)size;
+	return 0;
+}
+
+void arena_hugetlb_purge(void* addr, size_t size) {
+	// huge pages can only be dropped whole, partly covered ones at both ends are kept
+	uintptr_t start = ((uintptr_t)addr + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1);
+	uintptr_t end = ((uintptr_t)addr + size) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1);
+	if (start < end) {
+#ifndef _WIN32
+		madvise((void*)start, end - start, MADV_DONTNEED);
+#endif
+	}
+}
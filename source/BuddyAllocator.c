@@ -1,154 +1,289 @@
 #include"BuddyAllocator.h"
 #include"Utility.h"
 
-
-buddy_header_t* b_header = NULL;
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+
+buddy_header_t* volatile b_zones[BUDDY_ZONE_MAX] = { NULL };
+volatile long b_zone_num = 0;
+
+// zone registrations are serialized, readers do not take it
+static spinlock_t b_zones_lock = SPINLOCK_INIT;
+
+// zone preferred by current thread, -1 until first allocation
+static THREAD_LOCAL int thread_zone = -1;
+
+static int current_node() {
+	// numa node of the cpu that runs calling thread, 0 if it can not be found
+#if defined(_WIN32)
+	PROCESSOR_NUMBER proc;
+	USHORT node;
+	GetCurrentProcessorNumberEx(&proc);
+	return GetNumaProcessorNodeEx(&proc, &node) ? (int)node : 0;
+#elif defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu, node;
+	return (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) ? (int)node : 0;
+#else
+	return 0;
+#endif
+}
 
 void b_init(void* memstart, int blocknum) {
 
-	// put buddy header in first recieved block 
-	// currently header takes 140B
-	b_header = (buddy_header_t*)memstart;
+	// memory from memstart is committed by the caller
+	b_init_backed(memstart, blocknum, NULL);
+}
+
+int b_init_backed(void* memstart, int blocknum, const buddy_backing_t* backing) {
+
+	// memory from memstart becomes the only zone
+	atomic_store_release(&b_zone_num, 0);
+	return b_add_zone(memstart, blocknum, 0, backing) ? 0 : 1;
+}
+
+buddy_header_t* b_add_zone(void* memstart, int blocknum, int node, const buddy_backing_t* backing) {
+
+	if (b_zone_count() == BUDDY_ZONE_MAX) {
+		printf("ERROR in b_add_zone: max number of zones is %d\n", BUDDY_ZONE_MAX);
+		return NULL;
+	}
+
+	// first blocks are reserved for buddy header and page descriptor array
+	// array has one descriptor for every block (reserved blocks included, to keep the calculation simple)
+	size_t header_size = sizeof(buddy_header_t) + blocknum * sizeof(page_desc_t);
+	int header_blocks = div_round_up(header_size, BLOCK_SIZE);
+
+	if (backing) {
+		// header is the only part of reserved memory that is committed up front
+		if (backing->commit(memstart, (size_t)header_blocks * BLOCK_SIZE) != 0) {
+			printf("ERROR in b_add_zone: could not commit buddy header\n");
+			return NULL;
+		}
+
+		// memory for allocation starts on chunk boundary, so chunks line up with huge pages
+		uintptr_t chunk_bytes = (uintptr_t)POW2(BUDDY_CHUNK_ORDER + BLOCK_BIT_NUM);
+		uintptr_t header_stop = ((uintptr_t)memstart + (uintptr_t)header_blocks * BLOCK_SIZE + chunk_bytes - 1) & ~(chunk_bytes - 1);
+		header_blocks = (int)((header_stop - (uintptr_t)memstart) >> BLOCK_BIT_NUM);
+	}
+
+	// at least one block must stay for allocation after header
+	if (header_blocks >= blocknum) {
+		printf("ERROR in b_add_zone: %d blocks do not fit buddy header of %d blocks\n", blocknum, header_blocks);
+		return NULL;
+	}
+
+	// put buddy header in first recieved block of the zone
+	// so header of every zone is local to its memory
+	buddy_header_t* zone = (buddy_header_t*)memstart;
+	zone->node = node;
+	zone->backing = backing;
+	zone->idle_chunks = 0;
 
 	// create mutex for buddy allocator
-	b_header->buddy_mutex = CreateMutex(NULL, FALSE, NULL);
-	if (!b_header->buddy_mutex) {
+	if (mutex_init(&zone->buddy_mutex) != 0) {
 		printf("Error creating mutex for buddy allocator");
 	}
 
-	// first block is reserved for buddy header
-	b_header->header_start = (ptr_t)memstart;
+	zone->header_start = (ptr_t)memstart;
+
+	// page descriptors start right after buddy header
+	zone->pages = (page_desc_t*)(zone->header_start + sizeof(buddy_header_t));
 
-	// record end of buddy header to know where free space continues inside 1st block
-	b_header->header_end = b_header->header_start + sizeof(buddy_header_t);
+	// record end of header to know where free space continues inside header blocks
+	zone->header_end = zone->header_start + header_size;
 
-	// avaliable memory starts from block 2 
-	b_header->mem_start = (block_ptr_t)memstart + 1;
-	blocknum--;
+	// avaliable memory starts after header blocks
+	zone->mem_start = (block_ptr_t)memstart + header_blocks;
+	blocknum -= header_blocks;
 
-	// set the number of avaliable blocks (including 1 block for header)
-	b_header->block_num = blocknum;
+	// set the number of avaliable blocks (excluding header blocks)
+	zone->block_num = blocknum;
+
+	// no block has an owner yet
+	for (int i = 0; i < blocknum; ++i) {
+		zone->pages[i].cache = NULL;
+		zone->pages[i].slab = NULL;
+		zone->pages[i].free_order = -1;
+		zone->pages[i].large_order = -1;
+
+		// memory without backing store is always treated as dirty, it is never purged
+		zone->pages[i].chunk_state = backing ? BUDDY_CHUNK_RESERVED : BUDDY_CHUNK_DIRTY;
+	}
 
 	// initialization of buddy lists
 	for (int i = 0; i < BUDDY_SIZE; ++i){
-		b_header->buddies[i] = NULL;
+		zone->buddies[i] = NULL;
+	}
+	zone->free_orders = 0;
+	zone->free_blocks = 0;
+
+	// per-thread lists start empty and are filled on first use
+	for (int p = 0; p < BUDDY_PCP_NUM; ++p) {
+		spin_init(&zone->pcp[p].lock);
+		for (int i = 0; i < BUDDY_PCP_ORDERS; ++i) {
+			zone->pcp[p].blocks[i] = NULL;
+			zone->pcp[p].count[i] = 0;
+		}
 	}
 	
 	// initialization of free space
-	block_ptr_t current_mem = b_header->mem_start;
+	block_ptr_t current_mem = zone->mem_start;
 	while (blocknum != 0) {
 
 		// closest lower logarithm of 2 = index of list to add free space
 		int i = closest_lower_log2(blocknum);
 		
 		// allocate one node in i-th list
-		b_header->buddies[i] = (mem_node_t*) (current_mem);
-		b_header->buddies[i]->next = NULL;
+		b_push(zone, i, (mem_node_t*)current_mem);
 
-		int shift = pow(2, i);
 		// next free portion begins after 2^i blocks
-		current_mem += shift; 
+		current_mem += POW2(i); 
 
 		// continue for the remaining blocks
-		blocknum -= pow(2, i);
+		blocknum -= POW2(i);
 	}
-	
-}
-
-void * b_alloc(int block_num) {
 
-	//*****************************mutex wait************************************
-	DWORD wait_result = WaitForSingleObject(b_header->buddy_mutex, INFINITE);
-	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
+	// zone is visible to allocations only after it is fully initialized
+	// slot is filled before count is raised, so readers that see the count see the whole zone
+	spin_lock(&b_zones_lock);
+	int index = b_zone_count();
+	if (index == BUDDY_ZONE_MAX) {
+		spin_unlock(&b_zones_lock);
+		printf("ERROR in b_add_zone: max number of zones is %d\n", BUDDY_ZONE_MAX);
 		return NULL;
 	}
-	//***************************************************************************
+	zone->index = index;
+	atomic_store_ptr((void* volatile*)&b_zones[index], zone);
+	atomic_store_release(&b_zone_num, index + 1);
+	spin_unlock(&b_zones_lock);
 
+	return zone;
+}
+
+void * b_alloc(int block_num) {
+
+	// block_number is rounded to nearest higher power of 2
+	// index in buddies is nearest higher log of 2 
+	int buddy_index = closest_higher_log2(block_num);
 
-	// if it asks for more memory than total amount of memory stop now
-	if (block_num > b_header->block_num) {
+	// if it asks for more than the largest possible block stop now
+	if (buddy_index >= BUDDY_SIZE) {
 		printf("NOT ENOUGH MEMORY. ALLOCATION FAILED\n");
 		return NULL;
 	}
 
-	void* ret_addr = NULL;
+	// zone of the calling thread is tried first, then the following zones in order of registration
+	int preferred = b_thread_zone();
+	int zone_num = b_zone_count();
+	for (int i = 0; i < zone_num; ++i) {
+		void* ret_addr = b_zone_alloc(b_zones[(preferred + i) % zone_num], buddy_index);
+		if (ret_addr) {
+			return ret_addr;
+		}
+	}
 
-	// block_number is rounded to nearest higher power of 2
-	// index in buddies is nearest higher log of 2 
-	int buddy_index = closest_higher_log2(block_num);
+	// free address is not found in any zone
+	printf("NOT ENOUGH MEMORY. ALLOCATION FAILED\n");
+	return NULL;
+}
 
-	// if there is a free portion in requested size take it
-	if (b_header->buddies[buddy_index] != NULL) {
-		ret_addr = b_header->buddies[buddy_index];
+void* b_zone_alloc(buddy_header_t* zone, int buddy_index) {
+
+	void* ret_addr = NULL;
+
+	// small orders are served from per-thread list without taking buddy mutex
+	if (buddy_index < BUDDY_PCP_ORDERS) {
+		ret_addr = b_pcp_alloc(zone, buddy_index);
 	}
 
-	// else find first larger free portion and do splitting until desired size
-	else {
+	// larger orders, or when per-thread list could not be refilled
+	if (ret_addr == NULL) {
 
-		// remember where to stop splitting
-		int saved_index = buddy_index;
+		// blocks kept in per-thread lists are missing from buddies[], return them if there is no free space
+		if (zone->free_orders >> buddy_index == 0) {
+			b_drain_zone(zone);
+		}
 
-		// iterate trough array of lists to find first next larger portion
-		for (; buddy_index < BUDDY_SIZE; ++buddy_index) {
-			if (b_header->buddies[buddy_index] != NULL) break;
+		//*****************************mutex wait************************************
+		// could not get mutex
+		if (mutex_lock(&zone->buddy_mutex) != 0) {
+			return NULL;
 		}
+		//***************************************************************************
 
-		// next larger is found
-		if (buddy_index != BUDDY_SIZE) {
+		ret_addr = b_alloc_locked(zone, buddy_index);
 
-			// splitting will be done untill current list becomes the one from which we need to take a block
-			while (buddy_index > saved_index)
-			{
-				// take first node from current list
-				mem_node_t* temp = b_header->buddies[buddy_index];
+		//*****************************mutex signal************************************
+		if (mutex_unlock(&zone->buddy_mutex) != 0) {
+			printf("Error in releasing buddy mutex\n");
+		}
+		//*****************************************************************************
+	}
 
-				// remove it from current list
-				b_header->buddies[buddy_index] = b_header->buddies[buddy_index]->next;
+	return ret_addr;
+}
 
-				// split it to left and right buddy
-				// left buddy begins on same addres as the whole block 
-				mem_node_t* left = temp;
+void* b_alloc_locked(buddy_header_t* zone, int buddy_index) {
 
-				// start of the right buddy is shifted from start of left buddy by n/2 blocks
-				// where n = ( 2 ^ buddy_index )
-				mem_node_t* right = (mem_node_t*) ((block_ptr_t)left + (int)pow(2, (buddy_index - 1)));
+	// if there is no free portion in requested size
+	// find first larger free portion and do splitting until desired size
+	if (zone->buddies[buddy_index] == NULL && !b_split(zone, buddy_index)) {
+		return NULL;
+	}
 
-				// add both buddies to lower list (buddies[index - 1])
-				//printf("izvrseno je cepanje. u listu buddies[%d] se dodaju: %d i %d\n", buddy_index - 1, right, left);
-				right->next = b_header->buddies[buddy_index - 1];
-				left->next = right;
-				b_header->buddies[buddy_index - 1] = left;
+	// now there is a block to take in requested size list
+	mem_node_t* block = b_pop(zone, buddy_index);
 
-				// move to lower list and continue 
-				buddy_index--;
-			}
+	// memory of backing store is committed when it is handed out
+	if (zone->backing && !b_commit(zone, block, buddy_index)) {
+		printf("ERROR in b_alloc: could not commit memory\n");
+		b_free_locked(zone, block, buddy_index);
+		return NULL;
+	}
 
-			// now there is a block to take in requested size list
-			ret_addr = b_header->buddies[buddy_index];
-		}
+	return block;
+}
+
+int b_split(buddy_header_t* zone, int buddy_index) {
 
+	// remember where to stop splitting
+	int saved_index = buddy_index;
+
+	// first next larger portion is the lowest set bit of free_orders at or above buddy_index
+	unsigned larger = zone->free_orders & (~0u << buddy_index);
+
+	// no larger portion exists
+	if (!larger) {
+		return 0;
 	}
+	buddy_index = bit_ctz32(larger);
 
-	// free address is found
-	if (ret_addr != NULL)
+	// splitting will be done untill current list becomes the one from which we need to take a block
+	while (buddy_index > saved_index)
 	{
-		// remove it from its list
-		b_header->buddies[buddy_index] = b_header->buddies[buddy_index]->next;
-	}
+		// take first node from current list and remove it from current list
+		mem_node_t* temp = b_pop(zone, buddy_index);
 
-	// free address is not found
-	else {
-		printf("NOT ENOUGH MEMORY. ALLOCATION FAILED\n");
-	}
+		// split it to left and right buddy
+		// left buddy begins on same addres as the whole block 
+		mem_node_t* left = temp;
 
-	//*****************************mutex signal************************************
-	if (!ReleaseMutex(b_header->buddy_mutex)) {
-		printf("Error in releasing buddy mutex\n");
+		// start of the right buddy is shifted from start of left buddy by n/2 blocks
+		// where n = ( 2 ^ buddy_index )
+		mem_node_t* right = (mem_node_t*) ((block_ptr_t)left + POW2(buddy_index - 1));
+
+		// add both buddies to lower list (buddies[index - 1])
+		b_push(zone, buddy_index - 1, right);
+		b_push(zone, buddy_index - 1, left);
+
+		// move to lower list and continue 
+		buddy_index--;
 	}
-	//*****************************************************************************
 
-	return ret_addr;
+	return 1;
 }
 
 void b_free(void* addr, int block_num)
@@ -158,133 +293,629 @@ void b_free(void* addr, int block_num)
 		return;
 	}
 
+	// block is returned to the zone it was taken from
+	buddy_header_t* zone = b_zone_of(addr);
+	if (!zone) {
+		printf("ERROR in b_free: address is not inside of any zone\n");
+		return;
+	}
+
+	// block number is rounded to nearest higher pow 2, so the block is freed as one node
+	int buddy_index = closest_higher_log2(block_num);
+
+	// small orders go to per-thread list without taking buddy mutex
+	if (buddy_index < BUDDY_PCP_ORDERS) {
+		b_pcp_free(zone, addr, buddy_index);
+		return;
+	}
+
 	//*****************************mutex wait************************************
-	DWORD wait_result = WaitForSingleObject(b_header->buddy_mutex, INFINITE);
 	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
-		return NULL;
+	if (mutex_lock(&zone->buddy_mutex) != 0) {
+		return;
 	}
 	//***************************************************************************
 
-	// round to nearest higher pow 2
-	block_num = closest_higher_pow2(block_num);
+	b_free_locked(zone, addr, buddy_index);
+
+	//*****************************mutex signal************************************
+	if (mutex_unlock(&zone->buddy_mutex) != 0) {
+		printf("Error in releasing buddy mutex\n");
+	}
+	//*****************************************************************************
+}
+
+void b_free_locked(buddy_header_t* zone, void* addr, int buddy_index)
+{
+	// add new free node to the list
+	b_push(zone, buddy_index, (mem_node_t*)addr);
+
+	// try to do merging 
+	int merged_index = b_merge(zone, buddy_index);
+
+	// whole chunks became free, their memory is given back to backing store once enough of them gather
+	// purging right away would make every split and merge of the same chunk a pair of system calls
+	if (zone->backing && merged_index >= BUDDY_CHUNK_ORDER) {
+		b_mark_idle(zone, addr, buddy_index);
+		if (zone->idle_chunks > BUDDY_IDLE_MAX) {
+			b_purge_zone(zone);
+		}
+	}
+}
+
+void* b_pcp_alloc(buddy_header_t* zone, int buddy_index)
+{
+	buddy_pcp_t* pcp = &zone->pcp[thread_slot() % BUDDY_PCP_NUM];
 
-	// freeing of memmory is done in chunks with power of 2 sizes
-	// merging of nodes may occur on every level except the last (largest)
-	block_ptr_t current_mem = (block_ptr_t) addr;
-	while (block_num != 0) {
+	spin_lock(&pcp->lock);
 
-		// closest lower logarithm of 2 - index of list to add the node
-		int i = closest_lower_log2(block_num);
+	// list is empty, refill it with a batch of blocks under one buddy mutex wait
+	if (pcp->count[buddy_index] == 0) {
 
-		// add new free node to the list
-		mem_node_t* current_node = (mem_node_t*)current_mem;
-		current_node->next = b_header->buddies[i];
-		b_header->buddies[i] = current_node;
+		//*****************************mutex wait************************************
+		// could not get mutex
+		if (mutex_lock(&zone->buddy_mutex) != 0) {
+			spin_unlock(&pcp->lock);
+			return NULL;
+		}
+		//***************************************************************************
 
-		// try to do merging 
-		b_merge(i);
+		for (int i = 0; i < BUDDY_PCP_BATCH; ++i) {
+			mem_node_t* node = (mem_node_t*)b_alloc_locked(zone, buddy_index);
+			if (!node) {
+				break;
+			}
+			node->next = pcp->blocks[buddy_index];
+			pcp->blocks[buddy_index] = node;
+			pcp->count[buddy_index]++;
+		}
 
-		// next free portion begins after 2^i blocks
-		current_mem += (int)pow(2, i);
+		//*****************************mutex signal************************************
+		if (mutex_unlock(&zone->buddy_mutex) != 0) {
+			printf("Error in releasing buddy mutex\n");
+		}
+		//*****************************************************************************
+	}
 
-		// continue for remainder of freeing blocks
-		block_num -= pow(2, i);
+	// take most recently freed block, it is most likely still in cpu cache
+	mem_node_t* node = pcp->blocks[buddy_index];
+	if (node) {
+		pcp->blocks[buddy_index] = node->next;
+		pcp->count[buddy_index]--;
 	}
 
-	//*****************************mutex signal************************************
-	if (!ReleaseMutex(b_header->buddy_mutex)) {
-		printf("Error in releasing buddy mutex\n");
+	spin_unlock(&pcp->lock);
+
+	return node;
+}
+
+void b_pcp_free(buddy_header_t* zone, void* addr, int buddy_index)
+{
+	buddy_pcp_t* pcp = &zone->pcp[thread_slot() % BUDDY_PCP_NUM];
+
+	spin_lock(&pcp->lock);
+
+	mem_node_t* node = (mem_node_t*)addr;
+	node->next = pcp->blocks[buddy_index];
+	pcp->blocks[buddy_index] = node;
+	pcp->count[buddy_index]++;
+
+	// list is above high watermark, spill a batch of coldest blocks (list tail) to buddies[]
+	if (pcp->count[buddy_index] > BUDDY_PCP_HIGH) {
+
+		mem_node_t* last = pcp->blocks[buddy_index];
+		for (int i = 1; i < pcp->count[buddy_index] - BUDDY_PCP_BATCH; ++i) {
+			last = last->next;
+		}
+		mem_node_t* spill = last->next;
+		last->next = NULL;
+		pcp->count[buddy_index] -= BUDDY_PCP_BATCH;
+
+		//*****************************mutex wait************************************
+		if (mutex_lock(&zone->buddy_mutex) == 0) {
+
+			while (spill) {
+				mem_node_t* next = spill->next;
+				b_free_locked(zone, spill, buddy_index);
+				spill = next;
+			}
+
+			//*****************************mutex signal************************************
+			if (mutex_unlock(&zone->buddy_mutex) != 0) {
+				printf("Error in releasing buddy mutex\n");
+			}
+			//*****************************************************************************
+		}
+	}
+
+	spin_unlock(&pcp->lock);
+}
+
+void b_drain_cache()
+{
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		b_drain_zone(b_zones[z]);
+	}
+}
+
+void b_drain_zone(buddy_header_t* zone)
+{
+	// every per-thread list is emptied into buddies[] so freed blocks can be merged again
+	for (int p = 0; p < BUDDY_PCP_NUM; ++p) {
+
+		buddy_pcp_t* pcp = &zone->pcp[p];
+
+		spin_lock(&pcp->lock);
+
+		//*****************************mutex wait************************************
+		if (mutex_lock(&zone->buddy_mutex) == 0) {
+
+			for (int i = 0; i < BUDDY_PCP_ORDERS; ++i) {
+				mem_node_t* node = pcp->blocks[i];
+				while (node) {
+					mem_node_t* next = node->next;
+					b_free_locked(zone, node, i);
+					node = next;
+				}
+				pcp->blocks[i] = NULL;
+				pcp->count[i] = 0;
+			}
+
+			//*****************************mutex signal************************************
+			if (mutex_unlock(&zone->buddy_mutex) != 0) {
+				printf("Error in releasing buddy mutex\n");
+			}
+			//*****************************************************************************
+		}
+
+		spin_unlock(&pcp->lock);
 	}
-	//*****************************************************************************
 }
 
-void b_merge(int buddy_index)
+int b_merge(buddy_header_t* zone, int buddy_index)
 {
 	// merging can be propagated until last level or until no buddies are found for merging
 	while (buddy_index<BUDDY_SIZE-1)
 	{
 		// when merging begins the new added node will always be the head of the list
-		mem_node_t* current_node = b_header->buddies[buddy_index];
+		mem_node_t* current_node = zone->buddies[buddy_index];
+
+		// blocks are numbered from memory start
+		// left and right buddy of size 2 ^ buddy_index differ only in bit buddy_index of their block number
+		uintptr_t current_num = ((uintptr_t)current_node - (uintptr_t)zone->mem_start) >> BLOCK_BIT_NUM;
+		uintptr_t buddy_num = current_num ^ ((uintptr_t)1 << buddy_index);
 
-		mem_node_t* buddy = NULL;
+		// buddy lies past the end of memory, stop merging
+		if (buddy_num + ((uintptr_t)1 << buddy_index) > (uintptr_t)zone->block_num) break;
 
-		// first check if current node is left or right buddy in it's pair
-		// every right buddy has 1 and every left buddy has 0 at specific position in binary notation
-		// that position is (log2 of the size) + (BLOCK_BIT_NUM) from the left
-		// that rule is only applied when addresses start from 0
-		// memory start addr must be substracted from node addr to simulate addresses starting from 0
+		// buddy is not a free block of the same size, stop merging
+		if (zone->pages[buddy_num].free_order != buddy_index) break;
 
-		// prepare mask for checking 
-		int check = 0b1 << (buddy_index+BLOCK_BIT_NUM);
+		// buddy is found, do merging
+		mem_node_t* buddy = (mem_node_t*)(zone->mem_start + buddy_num);
+
+		// remove both from the list
+		b_remove(zone, buddy_index, buddy);
+		b_remove(zone, buddy_index, current_node);
+
+		// merge them in one node and insert it to higher list (buddies[index+1])
+		// merged node always begins where left buddy begins
+		b_push(zone, buddy_index + 1, (current_node < buddy) ? current_node : buddy);
+
+		buddy_index++;
+	}
+
+	return buddy_index;
+}
+
+void b_push(buddy_header_t* zone, int buddy_index, mem_node_t* node)
+{
+	// list node is written into the block itself, its chunk must be accessible
+	if (zone->backing && !b_chunk_commit(zone, b_block_index(zone, node) >> BUDDY_CHUNK_ORDER)) {
+		printf("ERROR in b_push: could not commit memory of free block\n");
+	}
+
+	// insert free block at the head of buddies[buddy_index] and mark the order as not empty
+	node->prev = NULL;
+	node->next = zone->buddies[buddy_index];
+	if (node->next) {
+		node->next->prev = node;
+	}
+	zone->buddies[buddy_index] = node;
+	zone->free_orders |= 1u << buddy_index;
+	zone->free_blocks += (long)POW2(buddy_index);
 
-		// current is the right buddy
-		if ( ((uintptr_t)current_node - (uintptr_t)b_header->mem_start) & check) {
+	// tag first block so merging can check in O(1) if this block is free
+	zone->pages[b_block_index(zone, node)].free_order = buddy_index;
+}
 
-			// his left buddy is ( 2 ^ buddy_index ) blocks behind 
-			buddy = (mem_node_t*)((block_ptr_t)current_node - (int)pow(2, buddy_index));
+void b_remove(buddy_header_t* zone, int buddy_index, mem_node_t* node)
+{
+	// unlink free block from buddies[buddy_index]
+	// order is marked as empty when the last block is taken
+	if (node->prev) {
+		node->prev->next = node->next;
+	}
+	else {
+		zone->buddies[buddy_index] = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	}
+	if (!zone->buddies[buddy_index]) {
+		zone->free_orders &= ~(1u << buddy_index);
+	}
+	zone->free_blocks -= (long)POW2(buddy_index);
+
+	zone->pages[b_block_index(zone, node)].free_order = -1;
+}
+
+mem_node_t* b_pop(buddy_header_t* zone, int buddy_index)
+{
+	// remove free block from the head of buddies[buddy_index], list must not be empty
+	mem_node_t* node = zone->buddies[buddy_index];
+	b_remove(zone, buddy_index, node);
+	return node;
+}
+
+int b_chunk_commit(buddy_header_t* zone, uintptr_t chunk)
+{
+	// state of chunk is kept in descriptor of its first block
+	uintptr_t first = chunk << BUDDY_CHUNK_ORDER;
+	if (zone->pages[first].chunk_state != BUDDY_CHUNK_RESERVED) {
+		return 1;
+	}
+
+	// last chunk of zone may be shorter
+	uintptr_t count = POW2(BUDDY_CHUNK_ORDER);
+	if (first + count > (uintptr_t)zone->block_num) {
+		count = (uintptr_t)zone->block_num - first;
+	}
+
+	if (zone->backing->commit(zone->mem_start + first, (size_t)count << BLOCK_BIT_NUM) != 0) {
+		return 0;
+	}
+	zone->pages[first].chunk_state = BUDDY_CHUNK_CLEAN;
+	return 1;
+}
+
+int b_commit(buddy_header_t* zone, void* addr, int buddy_index)
+{
+	// every chunk that overlaps the block is committed and will need purging once it is free again
+	uintptr_t first = b_block_index(zone, addr);
+	uintptr_t last = first + POW2(buddy_index) - 1;
+	for (uintptr_t chunk = first >> BUDDY_CHUNK_ORDER; chunk <= last >> BUDDY_CHUNK_ORDER; ++chunk) {
+		if (!b_chunk_commit(zone, chunk)) {
+			return 0;
 		}
+		page_desc_t* desc = &zone->pages[chunk << BUDDY_CHUNK_ORDER];
+		if (desc->chunk_state == BUDDY_CHUNK_IDLE) {
+			zone->idle_chunks--;
+		}
+		desc->chunk_state = BUDDY_CHUNK_DIRTY;
+	}
+	return 1;
+}
 
-		// current is the left buddy
-		else {
+void b_mark_idle(buddy_header_t* zone, void* addr, int buddy_index)
+{
+	// chunks that became free: the freed block itself if it covers whole chunks, else the one chunk containing it
+	// chunks that were free before are already idle or clean
+	uintptr_t first = b_block_index(zone, addr);
+	uintptr_t count = POW2(buddy_index);
+	if (buddy_index < BUDDY_CHUNK_ORDER) {
+		first &= ~(POW2(BUDDY_CHUNK_ORDER) - 1);
+		count = POW2(BUDDY_CHUNK_ORDER);
+	}
 
-			// his right buddy is ( 2 ^ buddy_index ) blocks forward
-			buddy = (mem_node_t*)((block_ptr_t)current_node + (int)pow(2, buddy_index));
+	for (uintptr_t block = first; block < first + count; block += POW2(BUDDY_CHUNK_ORDER)) {
+		if (zone->pages[block].chunk_state == BUDDY_CHUNK_DIRTY) {
+			zone->pages[block].chunk_state = BUDDY_CHUNK_IDLE;
+			zone->idle_chunks++;
+		}
+	}
+}
 
+void b_purge_zone(buddy_header_t* zone)
+{
+	// idle chunks always lie inside of free blocks of chunk order or larger
+	for (int i = BUDDY_CHUNK_ORDER; i < BUDDY_SIZE && zone->idle_chunks > 0; ++i) {
+		for (mem_node_t* node = zone->buddies[i]; node; node = node->next) {
+
+			// neighbouring idle chunks are purged together
+			uintptr_t first = b_block_index(zone, node);
+			ptr_t run_start = NULL;
+			size_t run_size = 0;
+			for (uintptr_t block = first; block < first + POW2(i); block += POW2(BUDDY_CHUNK_ORDER)) {
+				page_desc_t* desc = &zone->pages[block];
+				if (desc->chunk_state != BUDDY_CHUNK_IDLE) {
+					continue;
+				}
+				desc->chunk_state = BUDDY_CHUNK_CLEAN;
+				zone->idle_chunks--;
+
+				// first block of free block holds its list node, it is kept
+				ptr_t start = (ptr_t)(zone->mem_start + block);
+				size_t size = POW2(BUDDY_CHUNK_ORDER + BLOCK_BIT_NUM);
+				if (block == first) {
+					start += BLOCK_SIZE;
+					size -= BLOCK_SIZE;
+				}
+
+				if (run_start && run_start + run_size == start) {
+					run_size += size;
+					continue;
+				}
+				if (run_start) {
+					zone->backing->purge(run_start, run_size);
+				}
+				run_start = start;
+				run_size = size;
+			}
+			if (run_start) {
+				zone->backing->purge(run_start, run_size);
+			}
 		}
+	}
+}
 
-		// find the missing buddy in the list
-		mem_node_t* prev_node = NULL;
-		while (current_node && (current_node != buddy)) {
-			prev_node = current_node;
-			current_node = current_node->next;
+void b_purge()
+{
+	// gives memory of all idle chunks of all zones with backing store back to the system
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		buddy_header_t* zone = b_zones[z];
+		if (!zone->backing || zone->idle_chunks == 0) {
+			continue;
+		}
+
+		//*****************************mutex wait************************************
+		if (mutex_lock(&zone->buddy_mutex) != 0) {
+			continue;
 		}
+		//***************************************************************************
 
-		// buddy is not found, stop merging
-		if (!current_node) return;
+		b_purge_zone(zone);
 
-		// buddy is found, do merging
-		else {
+		//*****************************mutex signal************************************
+		if (mutex_unlock(&zone->buddy_mutex) != 0) {
+			printf("Error in releasing buddy mutex\n");
+		}
+		//*****************************************************************************
+	}
+}
+
+uintptr_t b_block_index(buddy_header_t* zone, const void* addr)
+{
+	// number of the block that contains addr, counted from start of zone memory
+	return ((uintptr_t)addr - (uintptr_t)zone->mem_start) >> BLOCK_BIT_NUM;
+}
+
+buddy_header_t* b_zone_of(const void* addr)
+{
+	// zone whose memory contains addr, NULL if addr is outside of all zones
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		buddy_header_t* zone = b_zones[z];
+		if ((ptr_t)addr >= (ptr_t)zone->mem_start && b_block_index(zone, addr) < (uintptr_t)zone->block_num) {
+			return zone;
+		}
+	}
+	return NULL;
+}
+
+page_desc_t* b_page_desc(const void* addr)
+{
+	// descriptor index is the number of the block that contains addr
+	buddy_header_t* zone = b_zone_of(addr);
+	if (!zone) {
+		return NULL;
+	}
+	return &zone->pages[b_block_index(zone, addr)];
+}
+
+void* b_block_start(const void* addr)
+{
+	// start address of the block that contains addr, NULL if addr is outside of all zones
+	buddy_header_t* zone = b_zone_of(addr);
+	if (!zone) {
+		return NULL;
+	}
+	return zone->mem_start + b_block_index(zone, addr);
+}
+
+int b_thread_zone()
+{
+	// zone is chosen on first call from every thread, by numa node of the cpu the thread runs on
+	int zone_num = b_zone_count();
+	if (thread_zone < 0) {
+		int node = current_node();
+		thread_zone = 0;
+		for (int z = 0; z < zone_num; ++z) {
+			if (b_zones[z]->node == node) {
+				thread_zone = z;
+				break;
+			}
+		}
+	}
+	return (thread_zone < zone_num) ? thread_zone : 0;
+}
 
-			mem_node_t* first_node = b_header->buddies[buddy_index];
+void b_set_thread_zone(int zone)
+{
+	// binds calling thread to a zone, overrides choice by numa node
+	thread_zone = zone;
+}
 
-			// remove the buddy from the list
-			prev_node->next = current_node->next;
+void b_set_owner(void* addr, int block_num, void* cache, void* slab)
+{
+	// record owner in descriptors of all blocks from addr to addr + block_num
+	// caller owns these blocks so no lock is needed
+	page_desc_t* page = b_page_desc(addr);
+	for (int i = 0; i < block_num; ++i) {
+		page[i].cache = cache;
+		page[i].slab = slab;
+	}
+}
 
-			// remove new node from the list
-			b_header->buddies[buddy_index] = b_header->buddies[buddy_index]->next;
+long b_free_blocks()
+{
+	// read without locks, result is a hint that may be slightly out of date
+	long blocks = 0;
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		buddy_header_t* zone = b_zones[z];
+		blocks += zone->free_blocks;
+		for (int p = 0; p < BUDDY_PCP_NUM; ++p) {
+			for (int i = 0; i < BUDDY_PCP_ORDERS; ++i) {
+				blocks += (long)zone->pcp[p].count[i] << i;
+			}
+		}
+	}
+	return blocks;
+}
 
-			// merge them in one node and insert it to higher list (buddies[index+1])
-			// merged node always begins where left buddy begins
+long b_total_blocks()
+{
+	long blocks = 0;
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		blocks += b_zones[z]->block_num;
+	}
+	return blocks;
+}
 
-			// first node is left node, add him to higher list
-			if (first_node < current_node) {
-				first_node->next = b_header->buddies[buddy_index + 1];
-				b_header->buddies[buddy_index + 1] = first_node;
+int b_check_consistency()
+{
+	// validates per-thread lists and buddies[] of every zone, prints every problem found
+	// returns number of problems, 0 if allocator is consistent
+	int errors = 0;
+
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		buddy_header_t* zone = b_zones[z];
+		block_ptr_t mem_end = zone->mem_start + zone->block_num;
+
+		// per-thread lists are checked first, their lock is taken before buddy mutex everywhere
+		for (int p = 0; p < BUDDY_PCP_NUM; ++p) {
+			spin_lock(&zone->pcp[p].lock);
+			for (int i = 0; i < BUDDY_PCP_ORDERS; ++i) {
+				int count = 0;
+				for (mem_node_t* node = zone->pcp[p].blocks[i]; node; node = node->next, ++count) {
+					if ((block_ptr_t)node < zone->mem_start || (block_ptr_t)node >= mem_end) {
+						printf("ERROR in b_check_consistency: zone %d per-thread list %d order %d holds block outside of zone\n", z, p, i);
+						errors++;
+						break;
+					}
+					if (zone->pages[b_block_index(zone, node)].free_order != -1) {
+						printf("ERROR in b_check_consistency: zone %d per-thread list %d order %d holds block that is also in buddies[]\n", z, p, i);
+						errors++;
+					}
+				}
+				if (count != zone->pcp[p].count[i]) {
+					printf("ERROR in b_check_consistency: zone %d per-thread list %d order %d has %d blocks, count is %d\n", z, p, i, count, zone->pcp[p].count[i]);
+					errors++;
+				}
 			}
+			spin_unlock(&zone->pcp[p].lock);
+		}
 
-			// buddy is left node, add him to higher list
-			else {
-				current_node->next = b_header->buddies[buddy_index + 1];
-				b_header->buddies[buddy_index + 1] = current_node;
+		//*****************************mutex wait************************************
+		if (mutex_lock(&zone->buddy_mutex) != 0) {
+			continue;
+		}
+		//***************************************************************************
+
+		long free_blocks = 0;
+		long nodes = 0;
+		for (int i = 0; i < BUDDY_SIZE; ++i) {
+
+			if (((zone->free_orders >> i) & 1) != (zone->buddies[i] != NULL)) {
+				printf("ERROR in b_check_consistency: zone %d free_orders bit %d does not match buddies[%d]\n", z, i, i);
+				errors++;
+			}
+
+			mem_node_t* prev = NULL;
+			for (mem_node_t* node = zone->buddies[i]; node; prev = node, node = node->next) {
+
+				// block must lie inside of zone, aligned to its size
+				if ((block_ptr_t)node < zone->mem_start || (block_ptr_t)node >= mem_end) {
+					printf("ERROR in b_check_consistency: zone %d buddies[%d] holds block outside of zone\n", z, i);
+					errors++;
+					break;
+				}
+				uintptr_t index = b_block_index(zone, node);
+				if ((index & (POW2(i) - 1)) != 0 || index + POW2(i) > (uintptr_t)zone->block_num) {
+					printf("ERROR in b_check_consistency: zone %d buddies[%d] holds misaligned block %lu\n", z, i, (unsigned long)index);
+					errors++;
+				}
+				if (node->prev != prev) {
+					printf("ERROR in b_check_consistency: zone %d buddies[%d] has broken prev link at block %lu\n", z, i, (unsigned long)index);
+					errors++;
+				}
+				if (zone->pages[index].free_order != i) {
+					printf("ERROR in b_check_consistency: zone %d block %lu is in buddies[%d] but tagged with order %d\n", z, (unsigned long)index, i, zone->pages[index].free_order);
+					errors++;
+				}
+				if (zone->pages[index].cache || zone->pages[index].slab || zone->pages[index].large_order != -1) {
+					printf("ERROR in b_check_consistency: zone %d free block %lu still has an owner\n", z, (unsigned long)index);
+					errors++;
+				}
+				free_blocks += (long)POW2(i);
+				nodes++;
 			}
+		}
 
-			//printf("spojeni su cvorovi sa pocecima %d i %d i spojeni cvor je ubacen u buddies[%d]\n", first_node, current_node, buddy_index + 1);
+		if (free_blocks != zone->free_blocks) {
+			printf("ERROR in b_check_consistency: zone %d has %ld blocks in buddies[], free_blocks is %ld\n", z, free_blocks, zone->free_blocks);
+			errors++;
+		}
 
-			buddy_index++;
+		// every tagged block must be the start of a listed free block, else free blocks overlap or tag is stale
+		long tagged = 0;
+		long idle = 0;
+		for (int i = 0; i < zone->block_num; ++i) {
+			if (zone->pages[i].free_order != -1) {
+				tagged++;
+			}
+			if (zone->pages[i].chunk_state == BUDDY_CHUNK_IDLE) {
+				idle++;
+			}
 		}
+		if (tagged != nodes) {
+			printf("ERROR in b_check_consistency: zone %d has %ld blocks tagged as free, %ld in buddies[]\n", z, tagged, nodes);
+			errors++;
+		}
+		if (zone->backing && idle != zone->idle_chunks) {
+			printf("ERROR in b_check_consistency: zone %d has %ld idle chunks, idle_chunks is %ld\n", z, idle, zone->idle_chunks);
+			errors++;
+		}
+
+		//*****************************mutex signal************************************
+		if (mutex_unlock(&zone->buddy_mutex) != 0) {
+			printf("Error in releasing buddy mutex\n");
+		}
+		//*****************************************************************************
 	}
+
+	return errors;
 }
 
 void b_print_state() {
-	for (int i = 0; i < BUDDY_SIZE; ++i) {
-		printf("Lista buddies[%d]: ", i);
-		mem_node_t* current = b_header->buddies[i];
-		while (current != NULL) {
-			printf("-> %d ", current);
-			current = current->next;
-		}
-		printf("\n");
+	int zone_num = b_zone_count();
+	for (int z = 0; z < zone_num; ++z) {
+		buddy_header_t* zone = b_zones[z];
+		printf("Zona %d (node %d):\n", z, zone->node);
+		for (int i = 0; i < BUDDY_SIZE; ++i) {
+			printf("Lista buddies[%d]: ", i);
+			mem_node_t* current = zone->buddies[i];
+			while (current != NULL) {
+				printf("-> %d ", current);
+				current = current->next;
+			}
+			printf("\n");
+		}
 	}
 }
 //
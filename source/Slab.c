@@ -1,9 +1,19 @@
 #define _CRT_SECURE_NO_WARNINGS
-#include "slab.h"
+#include "Slab.h"
 #include <string.h>
 #include "Utility.h"
 #include "BuddyAllocator.h"
+#include "Arena.h"
 
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+// number of blocks taken by kmem header
+#define KMEM_HEADER_BLOCKS (div_round_up(sizeof(kmem_header_t), BLOCK_SIZE))
+
+// order of largest kmalloc buffer, limited by buddies[] and by block count of b_alloc that is an int
+#define LARGE_BUFFER_MAX_ORDER ((BUDDY_SIZE - 1) < 30 ? (BUDDY_SIZE - 1) : 30)
 
 
 void init_cache(kmem_cache_t* new_cache, const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*)) {
@@ -11,7 +21,9 @@ void init_cache(kmem_cache_t* new_cache, const char* name, size_t size, void(*ct
 	// init name of the cache and all empty slab lists
 	strcpy(new_cache->name, name);
 	new_cache->slabs_empty = NULL;
-	new_cache->slabs_partial = NULL;
+	for (int i = 0; i < SLAB_PARTIAL_BUCKETS; ++i) {
+		new_cache->slabs_partial[i] = NULL;
+	}
 	new_cache->slabs_full = NULL;
 
 	// init slab count and object count and used % to 0
@@ -21,276 +33,458 @@ void init_cache(kmem_cache_t* new_cache, const char* name, size_t size, void(*ct
 	// shrink protect
 	new_cache->recently_added = 1;
 
-	// set object size
+	// set object size, rounded so every slot is aligned (objects may contain locks)
+	size = OBJ_ALIGN_UP(size);
 	new_cache->obj_size = size;
 
 	//calculate size for free map zone and unused space and num of objects per slab
 
+	new_cache->off_slab = 0;
+	new_cache->slab_blocks = calculate_slab_blocks(size, 0);
 	calculate_slab_areas(size,
+		new_cache->slab_blocks,
+		0,
 		&new_cache->free_map_size,
 		&new_cache->objects_per_slab,
 		&new_cache->unused_space);
 
-	// init L1 offset to 0
-	new_cache->next_L1_offset = 0;
+	// for large objects descriptor and map inside of slab can push slab to the next power of 2 blocks
+	// descriptor is then moved to slab-desc cache if that packs more objects in each block
+	if (size >= OFF_SLAB_MIN_SIZE && new_cache != &kmem_header->slab_desc_cache) {
+
+		size_t map_size, unused_space;
+		unsigned num_of_obj;
+		unsigned slab_blocks = calculate_slab_blocks(size, 1);
+		calculate_slab_areas(size, slab_blocks, 1, &map_size, &num_of_obj, &unused_space);
+
+		if (map_size <= OFF_SLAB_MAP_SIZE &&
+			(size_t)num_of_obj * new_cache->slab_blocks > (size_t)new_cache->objects_per_slab * slab_blocks) {
+
+			new_cache->off_slab = 1;
+			new_cache->slab_blocks = slab_blocks;
+			new_cache->free_map_size = map_size;
+			new_cache->objects_per_slab = num_of_obj;
+			new_cache->unused_space = unused_space;
+		}
+	}
+
+	// slab offsets are taken from unused space at the end of slab
+	cache_color_setup(new_cache, KMEM_COLOR_DEFAULT);
 
-	// init ctor and dtor to null 
+	// init ctor and dtor, objects are constructed when slab is added unless lazy construction is set
 	new_cache->ctor = ctor;
 	new_cache->dtor = dtor;
+	new_cache->lazy_ctor = 0;
 
 	// init error code to 0
 	new_cache->error_code = 0;
 
-	// insert into list
-	new_cache->next = kmem_header->cache_head;
-	kmem_header->cache_head = new_cache;
-
-	new_cache->cache_mutex = CreateMutex(NULL, FALSE, NULL);
-	if (!new_cache->cache_mutex) {
+	// init statistics counters to 0
+	new_cache->allocs = 0;
+	new_cache->frees = 0;
+	new_cache->last_grow = 0;
+	new_cache->empty_reserve = KMEM_RECLAIM_RESERVE;
+	new_cache->reclaim_pass = 0;
+	new_cache->grows = 0;
+	new_cache->reclaims = 0;
+	new_cache->contention = 0;
+	new_cache->high_water = 0;
+
+	if (mutex_init(&new_cache->cache_mutex) != 0) {
 		printf("Error creating mutex for cache: %s\n", new_cache->name);
 	}
+	spin_init(&new_cache->list_lock);
+
+	// magazines are created on first use of every per-thread slot
+	new_cache->magazine_size = magazine_default_size(size);
+	for (int i = 0; i < KMEM_CPU_NUM; ++i) {
+		spin_init(&new_cache->cpu_caches[i].lock);
+		new_cache->cpu_caches[i].loaded = NULL;
+		new_cache->cpu_caches[i].previous = NULL;
+		new_cache->cpu_caches[i].allocs = 0;
+		new_cache->cpu_caches[i].frees = 0;
+	}
+	spin_init(&new_cache->depot_lock);
+	new_cache->depot_full = NULL;
+	new_cache->depot_empty = NULL;
+
+	// no slab has remote frees
+	new_cache->remote_slabs = NULL;
+	new_cache->remote_frees = 0;
+	new_cache->remote_user_frees = 0;
+}
+
+void slab_list_remove(kmem_slab_t** list, kmem_slab_t* slab)
+{
+	// unlink slab from doubly linked list of slabs
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	}
+	else {
+		*list = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->next = slab->prev = NULL;
 }
 
-void move_partial_full(kmem_cache_t* cache)
+void slab_list_add(kmem_slab_t** list, kmem_slab_t* slab)
 {
-	// take first slab from partial list and move it to full list
-	kmem_slab_t* slab = cache->slabs_partial;
-	cache->slabs_partial = slab->next;
-	slab->next = cache->slabs_full;
-	cache->slabs_full = slab;
+	// insert slab at the head of doubly linked list of slabs
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list) {
+		(*list)->prev = slab;
+	}
+	*list = slab;
 }
 
-void move_empty_partial(kmem_cache_t* cache)
+kmem_slab_t** slab_list_head(kmem_cache_t* cache, int list)
 {
-	// take first slab from empty list and move it to partial list
-	kmem_slab_t* slab = cache->slabs_empty;
-	cache->slabs_empty = slab->next;
-	slab->next = cache->slabs_partial;
-	cache->slabs_partial = slab;
+	// head of the cache list with given SLAB_* id
+	if (list == SLAB_EMPTY) return &cache->slabs_empty;
+	if (list == SLAB_FULL) return &cache->slabs_full;
+	return &cache->slabs_partial[list - SLAB_PARTIAL];
 }
 
-void move_full_partial(kmem_cache_t* cache, kmem_slab_t* slab)
+int slab_list_id(kmem_cache_t* cache, unsigned inuse)
 {
-	// remove slab from full list and insert it to partial list
-	kmem_slab_t* curr = cache->slabs_full, *prev = NULL;
-	while (curr && curr != slab) {
-		prev = curr;
-		curr = curr->next;
-	}
-	// not found in full slabs, stop
-	if (!curr) return;
+	// id of the list for slab with inuse used slots
+	// partial slabs are bucketed by fraction of used slots, inuse < objects_per_slab keeps bucket below SLAB_PARTIAL_BUCKETS
+	if (inuse == 0) return SLAB_EMPTY;
+	if (inuse == cache->objects_per_slab) return SLAB_FULL;
+	return SLAB_PARTIAL + (int)((size_t)inuse * SLAB_PARTIAL_BUCKETS / cache->objects_per_slab);
+}
 
-	// found, remove it from full list
-	if (!prev) {
-		cache->slabs_full = curr->next;
-	}
-	else {
-		prev->next = curr->next;
+kmem_slab_t* slab_fullest_partial(kmem_cache_t* cache)
+{
+	// allocation fills the fullest partial slabs first, so free slots gather in few slabs and the rest can go empty
+	for (int i = SLAB_PARTIAL_BUCKETS - 1; i >= 0; --i) {
+		if (cache->slabs_partial[i]) {
+			return cache->slabs_partial[i];
+		}
 	}
-
-	// add to partial list
-	slab->next = cache->slabs_partial;
-	cache->slabs_partial = slab;
-
+	return NULL;
 }
 
-void move_partial_empty(kmem_cache_t* cache, kmem_slab_t* slab)
+kmem_slab_t* slab_pick(kmem_cache_t* cache)
 {
-	// remove slab from full list and insert it to partial list
-	kmem_slab_t* curr = cache->slabs_partial, * prev = NULL;
-	while (curr && curr != slab) {
-		prev = curr;
-		curr = curr->next;
+	// slab to allocate from, fullest partial first and empty last, list lock must be held
+	// slab that is locked by other thread is skipped, so threads allocating at the same time take slots of different slabs
+	// after SLAB_PICK_TRIES locked slabs the fullest one is waited for
+	// return is locked slab or NULL if cache has no free slot
+	kmem_slab_t* first = NULL;
+	unsigned tries = 0;
+
+	for (int list = SLAB_FULL - 1; list >= SLAB_EMPTY && tries < SLAB_PICK_TRIES; --list) {
+		for (kmem_slab_t* slab = *slab_list_head(cache, list); slab && tries < SLAB_PICK_TRIES; slab = slab->next) {
+			if (spin_trylock(&slab->lock)) {
+				return slab;
+			}
+			if (!first) {
+				first = slab;
+			}
+			++tries;
+		}
 	}
-	// not found in partial slabs, stop
-	if (!curr) return;
 
-	// found, remove it from partial list
-	if (!prev) {
-		cache->slabs_partial = curr->next;
+	if (first) {
+		spin_lock(&first->lock);
 	}
-	else {
-		prev->next = curr->next;
+	return first;
+}
+
+void slab_relink(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+	// move slab to the list that matches its number of used slots
+	int target = slab_list_id(cache, slab->inuse);
+
+	if (target == slab->list) {
+		return;
 	}
 
-	// add to empty list
-	slab->next = cache->slabs_empty;
-	cache->slabs_empty = slab;
+	slab_list_remove(slab_list_head(cache, slab->list), slab);
+	slab_list_add(slab_list_head(cache, target), slab);
+	slab->list = target;
 }
 
-int slab_empty(kmem_cache_t* cache,kmem_slab_t* slab)
+void slab_construct(kmem_cache_t* cache, kmem_slab_t* slab, unsigned first, unsigned end)
 {
-	octet* free = slab->free_slots_map;
-	for (int i = 0; i < cache->free_map_size; ++i) {
-		
-		// if any bit is 1 slab is not empty
-		if (*free != 0)
-			return 0;
+	// constructs slots from first up to end, called without locks on slots that only the caller can reach
+	// objects keep their constructed state while they are free, so every slot is constructed only once
+	ptr_t current_addr = (ptr_t)slab->obj_start_addr + (size_t)first * cache->obj_size;
+	for (unsigned i = first; i < end; ++i) {
+		cache->ctor(current_addr);
+		current_addr += cache->obj_size;
+	}
+}
 
-		++free;
+void slab_destruct(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+	// destructor is called once for every constructed slot, when slab memory goes back to buddy allocator
+	if (!cache->dtor) {
+		return;
+	}
+	ptr_t current_addr = (ptr_t)slab->obj_start_addr;
+	for (unsigned i = 0; i < slab->constructed; ++i) {
+		cache->dtor(current_addr);
+		current_addr += cache->obj_size;
 	}
-	return 1;
 }
 
-int partial_slab_full(kmem_cache_t* cache)
+unsigned slab_take_slots(kmem_cache_t* cache, kmem_slab_t* slab, unsigned n, void** objs, unsigned* construct_from)
 {
-	// return 1 if partial slab became full else return 0
+	// marks up to n free slots of slab as used and returns their addresses trough objs, slab lock must be held
+	// slots from *construct_from up to constructed were never handed out, caller constructs them after slab lock is released
+	// return is number of slots taken
 
-	octet* free_map = cache->slabs_partial->free_slots_map;
+	// words before free_hint have no free slot
+	// padding bits after the last slot are set, so they are never taken
+	unsigned words = cache->free_map_size / sizeof(map_word_t);
+	unsigned w = slab->free_hint;
+	unsigned cnt = 0;
+	*construct_from = slab->constructed;
 
-	// iterate trough all slots
-	for (int i = 0; i < cache->objects_per_slab; ++i)
-	{
-		// after every 8 slots move to next octet in free map
-		if ((i % BITS_PER_BYTE == 0) && (i != 0))
-			++free_map;
+	while (cnt < n && w < words) {
 
-		// if slot is empty slab is not full, stop
-		unsigned shift = (BITS_PER_BYTE - (i % BITS_PER_BYTE) - 1);
-		octet mask = 0b1 << shift;
-		if ((*free_map & mask)==0) {
-			return 0;
+		map_word_t word = slab->free_slots_map[w];
+
+		// all slots in this word are used
+		if (word == MAP_WORD_FULL) {
+			++w;
+			continue;
 		}
 
+		// lowest zero bit is the first free slot, mark it as used and return it's address
+		unsigned bit = bit_ctz64(~word);
+		slab->free_slots_map[w] = word | ((map_word_t)1 << bit);
+
+		unsigned slot = w * MAP_WORD_BITS + bit;
+		objs[cnt++] = (ptr_t)slab->obj_start_addr + slot * cache->obj_size;
+
+		// with lazy construction slot is constructed on its first hand-out
+		// lowest free slot is always taken, so slots that were never handed out are taken in order
+		if (slot >= slab->constructed) {
+			slab->constructed = slot + 1;
+		}
 	}
 
-	return 1; 
+	slab->free_hint = w;
+	return cnt;
 }
 
-int get_free_slot(kmem_cache_t* parent_cache, void** address) {
+int find_containing_slab(kmem_cache_t* cachep, void* objp, kmem_slab_t** res, unsigned* slot)
+{
+	// descriptor of the block that contains the object records owning cache and slab
+	page_desc_t* page = b_page_desc(objp);
 
-	// if partial slot exist take from it, else take from empty
-	kmem_slab_t* curr_slab = parent_cache->slabs_partial;
-	if (!curr_slab) {
-		curr_slab = parent_cache->slabs_empty;
+	// object is not inside of any slab of this cache
+	if (!page || page->cache != cachep) {
+		return OBJ_NOT_FOUND;
 	}
 
-	// if there is no empty or partial stop
-	if (!curr_slab) {
-		*address = 0;
-		return SLOT_NOT_FOUND;
+	// slot index is offset from first object divided by object size
+	kmem_slab_t* slab = (kmem_slab_t*)page->slab;
+	ptr_t first = (ptr_t)slab->obj_start_addr;
+	if ((ptr_t)objp < first) {
+		return OBJ_NOT_FOUND;
+	}
+	size_t offset = (ptr_t)objp - first;
+	if (offset % cachep->obj_size != 0 || offset / cachep->obj_size >= cachep->objects_per_slab) {
+		return OBJ_NOT_FOUND;
 	}
 
-	octet* free_map = curr_slab->free_slots_map;
-	ptr_t current_addr = (ptr_t)curr_slab->obj_start_addr;
-
-	// iterate trough all slots to find free slot
-	for (int i = 0; i < parent_cache->objects_per_slab; ++i)
-	{
-		// after every 8 slots move to next octet in free map
-		if ((i % BITS_PER_BYTE == 0) && (i != 0))
-			++free_map;
+	*res = slab;
+	*slot = offset / cachep->obj_size;
+	return (slab->list == SLAB_FULL) ? OBJ_FOUND_FULL : OBJ_FOUND_PARTIAL;
+}
 
-		// prepare mask for checking 
-		unsigned shift = (BITS_PER_BYTE - (i % BITS_PER_BYTE) - 1);
-		octet mask = 0b1 << shift;
 
-		// if slot is empty mark it as full and return it's address
-		if ( (*free_map & mask) == 0) {
+void cache_color_setup(kmem_cache_t* cachep, int level)
+{
+	// one color for every line of unused space, plus offset 0
+	// offsets past one way of hardware cache would map to the same sets as smaller ones
+	cachep->color_level = level;
+	cachep->color_next = 0;
+	if (level == 0) {
+		cachep->color_align = OBJ_ALIGN;
+		cachep->colors = 1;
+		return;
+	}
 
-			*free_map |= mask;
+	kmem_hw_cache_t* hw = &kmem_header->hw_caches[level - 1];
+	cachep->color_align = hw->line_size;
+	cachep->colors = (unsigned)(cachep->unused_space / hw->line_size) + 1;
+	if (cachep->colors > hw->way_size / hw->line_size) {
+		cachep->colors = hw->way_size / hw->line_size;
+	}
+}
 
-			*address = current_addr;
+int kmem_cache_set_lazy_ctor(kmem_cache_t* cachep, int lazy)
+{
+	// slabs that are already added keep their constructed slots, remaining ones are constructed on hand-out in both modes
 
-			return(curr_slab == parent_cache->slabs_partial) ? SLOT_FOUND_PARTIAL : SLOT_FOUND_EMPTY;
-		}
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (cache_lock(cachep) != 0) {
+		return ALLOCATION_ERROR;
+	}
+	//***************************************************************************
 
-		// if slot is full move to next slot
-		else {
-			current_addr += parent_cache->obj_size;
-		}
+	cachep->lazy_ctor = lazy ? 1 : 0;
 
-	}
+	//*****************************mutex signal************************************
+	cache_unlock(cachep);
+	//*****************************************************************************
 
-	// this was partial or empty slab but free slot not found
-	// this means there is an error in the cache
-	parent_cache->error_code = INCONSISTENT_SLAB_ERROR;
-	*address = 0;
-	return SLOT_NOT_FOUND;
+	return 0;
 }
 
-int find_containing_slab(kmem_cache_t* cachep, void* objp, kmem_slab_t** res)
+int kmem_cache_set_coloring(kmem_cache_t* cachep, int level)
 {
-	kmem_slab_t* current_slab = cachep->slabs_full;
-
-	// first check full slabs
-	while (current_slab) {
-
-		// check if addr is > than first obj addr and < than last
-		ptr_t first = (ptr_t)current_slab->obj_start_addr;
-		ptr_t last = first + cachep->objects_per_slab * cachep->obj_size;
-		if (objp >= first && objp <= last) {
+	if (level < 0 || level > KMEM_COLOR_LEVELS) {
+		printf("ERROR in kmem_cache_set_coloring: level must be between 0 and %d\n", KMEM_COLOR_LEVELS);
+		return ALLOCATION_ERROR;
+	}
 
-			*res = current_slab;
-			return OBJ_FOUND_FULL;
-		}
+	// existing slabs keep their offsets, only slabs added from now on are colored at new level
 
-		current_slab = current_slab->next;
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (cache_lock(cachep) != 0) {
+		return ALLOCATION_ERROR;
 	}
+	//***************************************************************************
 
+	cache_color_setup(cachep, level);
 
-	// if not found in full check partial slabs
-	if (!current_slab) {
-
-		current_slab = cachep->slabs_partial;
-		while (current_slab) {
+	//*****************************mutex signal************************************
+	cache_unlock(cachep);
+	//*****************************************************************************
 
-			// check if addr is > than first obj addr and < than last
-			ptr_t first = (ptr_t)current_slab->obj_start_addr;
-			ptr_t last = first + cachep->objects_per_slab * cachep->obj_size;
-			if (objp >= first && objp <= last) {
+	return 0;
+}
 
-				*res = current_slab;
-				return OBJ_FOUND_PARTIAL;
+void detect_hw_cache(int level, kmem_hw_cache_t* hw)
+{
+	// line size and way size of data cache at given level (1 or 2)
+	// defaults are used for anything that can not be found
+	hw->line_size = 0;
+	hw->way_size = 0;
+
+#if defined(_WIN32)
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION info[64];
+	DWORD len = sizeof(info);
+	if (GetLogicalProcessorInformation(info, &len)) {
+		for (DWORD i = 0; i < len / sizeof(info[0]); ++i) {
+			CACHE_DESCRIPTOR* c = &info[i].Cache;
+			if (info[i].Relationship == RelationCache && c->Level == level && c->Type != CacheInstruction) {
+				hw->line_size = c->LineSize;
+				hw->way_size = (c->Associativity && c->Associativity != CACHE_FULLY_ASSOCIATIVE) ? c->Size / c->Associativity : c->Size;
+				break;
 			}
-
-			current_slab = current_slab->next;
 		}
 	}
+#elif defined(__linux__)
+	// sysfs describes every cache of cpu0 in one directory, data and unified caches can be colored
+	for (int i = 0; i < 8 && hw->line_size == 0; ++i) {
+		char path[96], type[32];
+		unsigned values[3] = { 0, 0, 0 };
+		const char* files[3] = { "level", "coherency_line_size", "number_of_sets" };
+		int ok = 1;
+		for (int f = 0; f < 3 && ok; ++f) {
+			sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/%s", i, files[f]);
+			FILE* in = fopen(path, "r");
+			ok = in && fscanf(in, "%u", &values[f]) == 1;
+			if (in) fclose(in);
+		}
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+		FILE* in = fopen(path, "r");
+		ok = ok && in && fscanf(in, "%31s", type) == 1 && strcmp(type, "Instruction") != 0;
+		if (in) fclose(in);
+		if (ok && values[0] == (unsigned)level) {
+			hw->line_size = values[1];
+			hw->way_size = values[1] * values[2];
+		}
+	}
+#if defined(_SC_LEVEL1_DCACHE_LINESIZE)
+	// glibc reads the same from cpuid where sysfs is not mounted
+	if (hw->line_size == 0) {
+		long line = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_LINESIZE : _SC_LEVEL2_CACHE_LINESIZE);
+		long size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+		long assoc = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_ASSOC : _SC_LEVEL2_CACHE_ASSOC);
+		if (line > 0) {
+			hw->line_size = (unsigned)line;
+			hw->way_size = (size > 0 && assoc > 0) ? (unsigned)(size / assoc) : 0;
+		}
+	}
+#endif
+#endif
 
-	// not found
-	return OBJ_NOT_FOUND;
+	// line size must be a power of 2 that keeps slots aligned
+	if (hw->line_size < OBJ_ALIGN || !IS_POW2(hw->line_size)) {
+		hw->line_size = CACHE_L1_LINE_SIZE;
+	}
+	if (hw->way_size < hw->line_size) {
+		hw->way_size = BLOCK_SIZE;
+	}
 }
 
-
-unsigned calculate_slab_blocks(size_t obj_size)
+unsigned calculate_slab_blocks(size_t obj_size, int off_slab)
 {
-	// minimal cache contains header, 1 octet for map and 1 object
-	size_t min_size = sizeof(kmem_slab_t) + sizeof(octet) + obj_size;
+	// minimal cache contains header, 1 word for map and 1 object
+	// off-slab cache contains only 1 object
+	size_t min_size = off_slab ? obj_size : sizeof(kmem_slab_t) + sizeof(map_word_t) + obj_size;
 
 	// minimal number of blocks
-	int block_num = ceil((double)min_size / BLOCK_SIZE);
+	size_t block_num = div_round_up(min_size, BLOCK_SIZE);
 
 	// it is rounded to first higher pow of 2 
-	return closest_higher_pow2(block_num);
+	block_num = closest_higher_pow2(block_num);
+
+	// slab is doubled while unused space at the end is above target fraction of slab size
+	while (block_num < SLAB_BLOCKS_MAX) {
+		size_t map_size, unused_space;
+		unsigned num_of_obj;
+		calculate_slab_areas(obj_size, (unsigned)block_num, off_slab, &map_size, &num_of_obj, &unused_space);
+		if (unused_space <= ((block_num * BLOCK_SIZE) >> SLAB_WASTE_SHIFT)) {
+			break;
+		}
+		block_num <<= 1;
+	}
+
+	return (unsigned)block_num;
 }
 
 
 
 
-void calculate_slab_areas(size_t obj_size, size_t *map_size_p, unsigned *num_of_obj_p, size_t *unused_space_p){
+void calculate_slab_areas(size_t obj_size, unsigned slab_blocks, int off_slab, size_t *map_size_p, unsigned *num_of_obj_p, size_t *unused_space_p){
 	
-	// slab space = header + free map + objects(slots)
+	// slab space = header + free map + remote free map + objects(slots)
 	// header is always fixed size
 	// this function has to find sizes of free map zone and objects zone
 	// function also returns size of unused space in the slab
+	// off-slab slab space = objects(slots), header and free map are in separate descriptor
 
-	size_t slab_size = calculate_slab_blocks(obj_size)*BLOCK_SIZE;
+	size_t slab_size = (size_t)slab_blocks * BLOCK_SIZE;
 
 	unsigned num_of_obj = 0;
-	size_t map_size = 1;
+	size_t map_size = sizeof(map_word_t);
 
 	// free space for map and object is total size - header size
-	size_t space = slab_size - sizeof(kmem_slab_t);
+	size_t space = off_slab ? slab_size : slab_size - sizeof(kmem_slab_t);
 
 	// increment both values in a loop while there is free space
 	while(1){
 
-		// map size should increase by 1 byte for every 8 slots
-		size_t next_map_size = ((num_of_obj + 1) % BITS_PER_BYTE == 0) ? map_size + 1 : map_size;
+		// map size should increase by 1 word for every 64 slots
+		size_t next_map_size = ((num_of_obj + 1 + MAP_WORD_BITS - 1) / MAP_WORD_BITS) * sizeof(map_word_t);
 
 		// check if adding one more slot will cause overflow
-		if ((next_map_size + (num_of_obj + 1) * obj_size) <= space) {
+		// objects zone starts at aligned address after the map
+		if (((off_slab ? 0 : 2 * OBJ_ALIGN_UP(next_map_size)) + (num_of_obj + 1) * obj_size) <= space) {
 
 			// no overflow, add one more slot
 			++num_of_obj;
@@ -303,19 +497,22 @@ void calculate_slab_areas(size_t obj_size, size_t *map_size_p, unsigned *num_of_
 		}
 	} 
 
+	// map zone is padded so objects start aligned
+	map_size = OBJ_ALIGN_UP(map_size);
+
 	*map_size_p = map_size;
 	*num_of_obj_p = num_of_obj;
 
 	// space that is left after objects until the end of slab is unused
-	*unused_space_p = space - (map_size + num_of_obj * obj_size);
+	*unused_space_p = space - ((off_slab ? 0 : 2 * map_size) + num_of_obj * obj_size);
 
 }
 
 unsigned total_cache_blocks(kmem_cache_t* cachep)
 {
 	// total size = header + num of slabs * size of 1 slab
-	unsigned total_size = sizeof(kmem_cache_t) + cachep->slab_count * calculate_slab_blocks(cachep->obj_size) * BLOCK_SIZE;
-	unsigned total_blocks = ceil((double)(total_size) / BLOCK_SIZE);
+	unsigned total_size = sizeof(kmem_cache_t) + cachep->slab_count * cachep->slab_blocks * BLOCK_SIZE;
+	unsigned total_blocks = div_round_up(total_size, BLOCK_SIZE);
 	return total_blocks;
 }
 
@@ -323,443 +520,1539 @@ unsigned total_cache_blocks(kmem_cache_t* cachep)
 
 kmem_cache_t* find_cache(const char* name){
 
+	// lookup is done without locks, reader count of this thread slot keeps found cache from being reused
+	kmem_reader_t* reader = &kmem_header->registry_readers[thread_slot() % KMEM_CPU_NUM];
+	long half = atomic_load_full(&kmem_header->registry_epoch) & 1;
+	atomic_add_full(&reader->count[half], 1);
+
+	long seq = atomic_load_full(&kmem_header->registry_seq);
+	kmem_cache_t* found = registry_lookup(name);
+
+	// miss is certain only if table was not rebuilt meanwhile and no cache is left out of it
+	int retry = !found && ((seq & 1) || atomic_load_full(&kmem_header->registry_seq) != seq || atomic_load_full(&kmem_header->registry_overflow) != 0);
+
+	atomic_add_full(&reader->count[half], -1);
+
+	if (!retry) {
+		return found; // NULL if not found
+	}
+
 	//*****************************mutex wait************************************
-	DWORD wait_result = WaitForSingleObject(kmem_header->cache_list_mutex, INFINITE);
 	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
+	if (mutex_lock(&kmem_header->cache_list_mutex) != 0) {
 		return NULL;
 	}
 	//***************************************************************************
 
-	// iterate trough all caches in list to find requested name
-	kmem_cache_t* curr = kmem_header->cache_head;
-	while (curr) {
-		if (strcmp(curr->name, name) == 0) {
-
-			//*****************************mutex signal************************************
-			if (!ReleaseMutex(kmem_header->cache_list_mutex)) {
-				printf("Error in releasing mutex for list of all caches");
-			}
-			//*****************************************************************************
-			return curr;
-		}
-		curr = curr->next;
-	}
+	found = cache_lookup_locked(name);
 
 	//*****************************mutex signal************************************
-	if (!ReleaseMutex(kmem_header->cache_list_mutex)) {
-		printf("Error in releasing mutex for list of all caches");
+	if (mutex_unlock(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error in releasing mutex for list of all caches\n");
 	}
 	//*****************************************************************************
 
-	return NULL; // not found
+	return found;
 }
 
-void print_list_of_caches(){
-	kmem_cache_t* curr = kmem_header->cache_head;
-	while (curr) {
-		kmem_cache_info(curr);
-		printf("\n");
-		curr = curr->next;
+unsigned registry_hash(const char* name)
+{
+	// FNV-1a hash of cache name
+	unsigned hash = 2166136261u;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
 	}
+	return hash;
 }
 
-void kmem_init(void* space, int block_num){
-
-	// initialize buddy allocator
-	b_init(space, block_num);
-
-	// place kmem header after buddy header inside 1st block
-	kmem_header = (kmem_header_t*)b_header->header_end;
+kmem_cache_t* registry_lookup(const char* name)
+{
+	// linear probing from hash slot until the name or an empty slot is found
+	// caller must be registered as reader or hold list mutex
+	unsigned index = registry_hash(name);
+	for (unsigned i = 0; i < KMEM_REGISTRY_SIZE; ++i) {
 
-	// init list of all caches to NULL
-	kmem_header->cache_head = NULL;
+		kmem_cache_t* cachep = (kmem_cache_t*)atomic_load_ptr((void* volatile*)&kmem_header->registry[(index + i) & (KMEM_REGISTRY_SIZE - 1)]);
 
+		// empty slot ends the probe sequence
+		if (!cachep) {
+			return NULL;
+		}
 
-	// create mutex for list of all caches
-	kmem_header->cache_list_mutex = CreateMutex(NULL, FALSE, NULL);
-	if (!kmem_header->cache_list_mutex) {
-		printf("Error creating mutex for list of all caches");
+		if (cachep != REGISTRY_TOMBSTONE && strcmp(cachep->name, name) == 0) {
+			return cachep;
+		}
 	}
-	
-	// initialize cache of caches
-	init_cache(&kmem_header->cache_of_caches, "cachecache", sizeof(kmem_cache_t), NULL, NULL);
+	return NULL;
+}
 
-	// initialize small mem buffers
-	char name_buffer[CACHE_NAME_SIZE];
-	for (int i = SMALL_BUFFER_LOWER_LIMIT; i <= SMALL_BUFFER_UPPER_LIMIT; ++i) {
+int registry_insert(kmem_cache_t* cachep)
+{
+	// cache is published in the first empty or tombstone slot of its probe sequence
+	// list mutex must be held, cache must be fully initialized
+	unsigned index = registry_hash(cachep->name);
+	for (unsigned i = 0; i < KMEM_REGISTRY_SIZE; ++i) {
 
-		// name of small buffer
-		sprintf(name_buffer, "size-%d", i);
-		init_cache(&kmem_header->small_buffer_caches[i], name_buffer, pow(2, i), NULL, NULL);
-	}
+		kmem_cache_t* volatile* slot = &kmem_header->registry[(index + i) & (KMEM_REGISTRY_SIZE - 1)];
 
-	// set head of caches list to cache of caches
-	kmem_header->cache_head = &kmem_header->cache_of_caches;
+		if (*slot == NULL || *slot == REGISTRY_TOMBSTONE) {
+			if (*slot == REGISTRY_TOMBSTONE) {
+				kmem_header->registry_tombstones--;
+			}
+			atomic_store_ptr((void* volatile*)slot, cachep);
+			kmem_header->registry_used++;
+			return 0;
+		}
+	}
 
-	// set ending address 
-	kmem_header->header_end = (ptr_t)kmem_header + sizeof(kmem_header_t);
+	// registry is full
+	return ALLOCATION_ERROR;
 }
 
-kmem_cache_t* kmem_cache_create(const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*)){
+int registry_remove(kmem_cache_t* cachep)
+{
+	// slot is replaced by tombstone so probe sequences of other names stay unbroken
+	// list mutex must be held, return is 0 if cache was not in registry
+	unsigned index = registry_hash(cachep->name);
+	for (unsigned i = 0; i < KMEM_REGISTRY_SIZE; ++i) {
 
-	// if cache already exists return it
-	kmem_cache_t* found = find_cache(name);
-	if (found) return found;
+		kmem_cache_t* volatile* slot = &kmem_header->registry[(index + i) & (KMEM_REGISTRY_SIZE - 1)];
 
-	// allocate one cache from cache of caches
-	ptr_t free_addr = (ptr_t)kmem_cache_alloc(&kmem_header->cache_of_caches);
+		if (*slot == NULL) {
+			return 0;
+		}
+		if (*slot == cachep) {
+			atomic_store_ptr((void* volatile*)slot, REGISTRY_TOMBSTONE);
+			kmem_header->registry_tombstones++;
+			kmem_header->registry_used--;
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	if (!free_addr) {
-		kmem_header->cache_of_caches.error_code = ALLOCATION_ERROR;
-		printf("ERROR in kmem_cache_create: allocation failed\nerror code: %d\n",kmem_header->cache_of_caches.error_code);
-		return NULL;
+void registry_rebuild()
+{
+	// registry is cleared and filled again from list of all caches, which drops tombstones
+	// and moves in caches that did not fit before, list mutex must be held
+	// odd sequence tells lock-free readers that their misses are not reliable
+	atomic_add_full(&kmem_header->registry_seq, 1);
+
+	for (int i = 0; i < KMEM_REGISTRY_SIZE; ++i) {
+		atomic_store_ptr((void* volatile*)&kmem_header->registry[i], NULL);
 	}
+	kmem_header->registry_tombstones = 0;
+	kmem_header->registry_used = 0;
 
-	// initialize new cache
-	kmem_cache_t* new_cache = (kmem_cache_t*)free_addr;
-	init_cache(new_cache, name, size, ctor, dtor);
+	long overflow = 0;
+	for (kmem_cache_t* curr = kmem_header->cache_head; curr; curr = curr->next) {
+		if (registry_insert(curr) != 0) {
+			overflow++;
+		}
+	}
+	atomic_xchg(&kmem_header->registry_overflow, overflow);
 
-	return new_cache;
+	atomic_add_full(&kmem_header->registry_seq, 1);
 }
 
-int extend_cache(kmem_cache_t* cache) {
+void registry_wait_readers()
+{
+	// grace period: every reader that could have seen a removed cache has finished
+	// readers that start now can not find it any more
+	// new readers count in the other half after the flip, so counts of the old half only go down
+	// and busy lookups can not keep a reader count above zero forever
 
-	// return is error code
+	//*****************************mutex wait************************************
+	if (mutex_lock(&kmem_header->registry_gp_mutex) != 0) {
+		return;
+	}
+	//***************************************************************************
 
-	// calculate num of blocks needed for 1 slab and allocate it
-	unsigned block_num = calculate_slab_blocks(cache->obj_size);
-	kmem_slab_t* new_slab = (kmem_slab_t*)b_alloc(block_num);
+	long old = atomic_load_full(&kmem_header->registry_epoch) & 1;
+	atomic_add_full(&kmem_header->registry_epoch, 1);
 
-	if (!new_slab) {
-		//buddy allocation failed, error code 1
-		return 1;
+	for (int i = 0; i < KMEM_CPU_NUM; ++i) {
+		unsigned spins = 0;
+		while (atomic_load_full(&kmem_header->registry_readers[i].count[old]) != 0) {
+			cpu_relax();
+			if (++spins == SPIN_YIELD_LIMIT) {
+				cpu_yield();
+				spins = 0;
+			}
+		}
 	}
 
-	// free map starts after header
-	new_slab->free_slots_map = (octet*)new_slab + sizeof(kmem_slab_t);
+	//*****************************mutex signal************************************
+	if (mutex_unlock(&kmem_header->registry_gp_mutex) != 0) {
+		printf("Error in releasing mutex for registry grace period\n");
+	}
+	//*****************************************************************************
+}
 
-	// initialize free map to al 0 (all free slots)
-	octet* free_map = new_slab->free_slots_map;
-	for (int i = 0; i < cache->free_map_size; ++i) {
-		*(free_map) = 0;
-		++free_map;
+kmem_cache_t* cache_lookup_locked(const char* name)
+{
+	// registry lookup that also finds caches left out of full registry, list mutex must be held
+	kmem_cache_t* found = registry_lookup(name);
+	if (found || kmem_header->registry_overflow == 0) {
+		return found;
 	}
 
-	// assign L1 offset from cache
-	new_slab->L1_offset = cache->next_L1_offset;
+	for (kmem_cache_t* curr = kmem_header->cache_head; curr; curr = curr->next) {
+		if (strcmp(curr->name, name) == 0) {
+			return curr;
+		}
+	}
+	return NULL;
+}
 
-	// objects start after header + free map size + L1 offset
-	new_slab->obj_start_addr = (ptr_t)new_slab + sizeof(kmem_slab_t) + cache->free_map_size + cache->next_L1_offset;
+void cache_register(kmem_cache_t* cachep)
+{
+	// adds cache to list of all caches and to registry, list mutex must be held
+	// if registry is full cache is only in the list and is found by locked lookup
+	cachep->next = kmem_header->cache_head;
+	kmem_header->cache_head = cachep;
 
-	// update next L1 offset for cache
-	cache->next_L1_offset = (cache->next_L1_offset + 64 > cache->unused_space)
-		? 0
-		: cache->next_L1_offset + 64;
+	if (registry_insert(cachep) != 0) {
+		atomic_add_full(&kmem_header->registry_overflow, 1);
+	}
+}
 
+int cache_unregister(kmem_cache_t* cachep)
+{
+	// removes cache from list of all caches and from registry, list mutex must be held
+	// return is 0 if cache is not in the list
+	kmem_cache_t* curr = kmem_header->cache_head, * prev = NULL;
+	while (curr && curr != cachep) {
+		prev = curr;
+		curr = curr->next;
+	}
+	if (!curr) {
+		return 0;
+	}
+	if (prev) {
+		prev->next = curr->next;
+	}
+	else {
+		kmem_header->cache_head = curr->next;
+	}
 
-	// initialize all objects by calling constructors
-	ptr_t current_addr = (ptr_t)new_slab->obj_start_addr;
-	for (int i = 0; i < cache->objects_per_slab; ++i) {
+	if (!registry_remove(cachep)) {
+		atomic_add_full(&kmem_header->registry_overflow, -1);
+	}
 
-		if (cache->ctor != NULL) {
-			cache->ctor(current_addr);
-		}
+	// too many tombstones make misses probe far, without empty slots a miss probes whole registry
+	// freed slot lets caches out of the list back in
+	unsigned taken = kmem_header->registry_used + kmem_header->registry_tombstones;
+	if (kmem_header->registry_tombstones * 4 > KMEM_REGISTRY_SIZE || taken * 8 > KMEM_REGISTRY_SIZE * 7 || kmem_header->registry_overflow != 0) {
+		registry_rebuild();
+	}
+	return 1;
+}
 
-		current_addr += cache->obj_size;
+void print_list_of_caches(){
+	kmem_cache_t* curr = kmem_header->cache_head;
+	while (curr) {
+		kmem_cache_info(curr);
+		printf("\n");
+		curr = curr->next;
 	}
+}
 
-	// add new slab to empty slabs list 
-	new_slab->next = cache->slabs_empty;
-	cache->slabs_empty = new_slab;
+void kmem_init(void* space, int block_num){
 
-	// incr cache slab count and update used_pct
-	cache->slab_count++;
-	cache->recently_added = 1;
+	// initialize buddy allocator
+	b_init(space, block_num);
 
-	return 0;
+	kmem_setup();
 }
 
+void* kmem_init_arena(size_t size, int flags){
 
-int kmem_cache_shrink(kmem_cache_t* cachep){
-
-	//*****************************mutex wait************************************
-	DWORD wait_result = WaitForSingleObject(cachep->cache_mutex, INFINITE);
-	// could not get mutex
-	if (wait_result == WAIT_ABANDONED) {
+	// only virtual address range is taken here, memory is committed as buddy allocator hands it out
+	const buddy_backing_t* backing;
+	void* space = arena_reserve(size, flags, &backing);
+	if (!space) {
+		printf("ERROR in kmem_init_arena: could not reserve arena\n");
 		return NULL;
 	}
-	//***************************************************************************
 
-	if (cachep->recently_added==1) {
-		cachep->recently_added = 0;
-		//*****************************mutex signal************************************
-		if (!ReleaseMutex(cachep->cache_mutex)) {
-			printf("Error in releasing mutex for cache: %s\n", cachep->name);
-		}
-		//*****************************************************************************
-		return 0;
+	// initialize buddy allocator over reserved range, range must hold more than buddy header
+	if (b_init_backed(space, (int)(size >> BLOCK_BIT_NUM), backing) != 0) {
+		printf("ERROR in kmem_init_arena: arena of %zu bytes is too small\n", size);
+		arena_release(space, size);
+		return NULL;
 	}
 
-	// deallocate all empty slabs 
-	// update slab count of cachep
-	// returns count of deallocated slabs
+	kmem_setup();
+	return space;
+}
 
-	kmem_slab_t* curr_slab = cachep->slabs_empty;
+void kmem_setup(){
 
-	int cnt = 0;
+	// kmem header holds a lock for every cache and does not fit next to buddy header in 1st block
+	// it is allocated from buddy allocator as a separate run of blocks
+	kmem_header = (kmem_header_t*)b_alloc(KMEM_HEADER_BLOCKS);
+	if (!kmem_header) {
+		printf("ERROR in kmem_init: not enough memory for kmem header\n");
+		return;
+	}
 
-	while (curr_slab) {
+	// init list of all caches to NULL
+	kmem_header->cache_head = NULL;
+
+	// reclaimer is not running until kmem_reclaim_start
+	kmem_header->grow_clock = 0;
+	kmem_header->reclaim_running = 0;
+	kmem_header->reclaim_passes = 0;
+
+	// registry starts empty, with no readers
+	for (int i = 0; i < KMEM_REGISTRY_SIZE; ++i) {
+		kmem_header->registry[i] = NULL;
+	}
+	kmem_header->registry_seq = 0;
+	kmem_header->registry_tombstones = 0;
+	kmem_header->registry_used = 0;
+	kmem_header->registry_overflow = 0;
+	for (int i = 0; i < KMEM_CPU_NUM; ++i) {
+		kmem_header->registry_readers[i].count[0] = 0;
+		kmem_header->registry_readers[i].count[1] = 0;
+	}
+	kmem_header->registry_epoch = 0;
+
+
+	// hardware cache geometry is needed before first cache is initialized
+	for (int i = 0; i < KMEM_COLOR_LEVELS; ++i) {
+		detect_hw_cache(i + 1, &kmem_header->hw_caches[i]);
+	}
+
+	// create mutex for list of all caches
+	if (mutex_init(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error creating mutex for list of all caches");
+	}
+	if (mutex_init(&kmem_header->registry_gp_mutex) != 0) {
+		printf("Error creating mutex for registry grace period");
+	}
+	
+	// initialize cache of off-slab descriptors first, other internal caches may be off-slab
+	// it must not use magazines, magazine cache may allocate descriptors from it
+	init_cache(&kmem_header->slab_desc_cache, "slab-desc", sizeof(kmem_slab_t) + 2 * OFF_SLAB_MAP_SIZE, NULL, NULL);
+	kmem_header->slab_desc_cache.magazine_size = 0;
+	cache_register(&kmem_header->slab_desc_cache);
+
+	// initialize cache of caches
+	init_cache(&kmem_header->cache_of_caches, "cachecache", sizeof(kmem_cache_t), NULL, NULL);
+	cache_register(&kmem_header->cache_of_caches);
+
+	// initialize cache of magazines, it must not use magazines itself
+	init_cache(&kmem_header->magazine_cache, "magazine", sizeof(kmem_magazine_t), NULL, NULL);
+	kmem_header->magazine_cache.magazine_size = 0;
+	cache_register(&kmem_header->magazine_cache);
+
+	// initialize small mem buffers, one cache for every size class
+	char name_buffer[CACHE_NAME_SIZE];
+	for (unsigned i = 0; i < SMALL_BUFFER_NUM; ++i) {
+
+		// name of small buffer is its size in bytes
+		size_t size = small_buffer_class_size(i);
+		sprintf(name_buffer, "size-%u", (unsigned)size);
+		init_cache(&kmem_header->small_buffer_caches[i], name_buffer, size, NULL, NULL);
+		cache_register(&kmem_header->small_buffer_caches[i]);
+	}
+
+	// lookup table for small sizes, entry i holds class of size i * 2^SMALL_BUFFER_TABLE_SHIFT
+	// sizes in between round up to next entry, class boundaries are multiples of table step
+	for (unsigned i = 0; i <= (SMALL_BUFFER_TABLE_MAX >> SMALL_BUFFER_TABLE_SHIFT); ++i) {
+		kmem_header->small_buffer_table[i] = (unsigned char)small_buffer_class(i << SMALL_BUFFER_TABLE_SHIFT);
+	}
+
+	// internal caches are in the list of caches and registry too
+
+	// set ending address 
+	kmem_header->header_end = (ptr_t)kmem_header + sizeof(kmem_header_t);
+}
+
+void kmem_add_zone(void* space, int block_num, int node){
+
+	// zone is a separate buddy allocator, slabs of all caches may be placed in it
+	if (!b_add_zone(space, block_num, node, NULL)) {
+		printf("ERROR in kmem_add_zone: zone could not be added\n");
+	}
+}
+
+int slabs_release(kmem_cache_t* cachep, unsigned keep)
+{
+	// returns empty slabs to buddy allocator, cache mutex must be held
+	// first keep slabs of empty list (most recently emptied) stay in cache
+	// slabs are unlinked under list lock, destructors and buddy frees run after it is released
+	// returns count of deallocated slabs
+
+	kmem_slab_t* released = NULL;
+	int cnt = 0;
+
+	slab_lists_lock(cachep);
+
+	// slabs emptied by remote frees are released too
+	slab_drain_remote(cachep);
+
+	kmem_slab_t* curr_slab = cachep->slabs_empty;
+	for (unsigned i = 0; i < keep && curr_slab; ++i) {
+		curr_slab = curr_slab->next;
+	}
+
+	while (curr_slab) {
 		kmem_slab_t* tmp = curr_slab;
 		curr_slab = curr_slab->next;
-		b_free(tmp, calculate_slab_blocks(cachep->obj_size));
+
+		// remote writer whose object was merged by other thread may still be pushing the slab, it is released next time
+		// writer that finished after the drain above may have pushed the emptied slab to remote list,
+		// it is released after next drain unlinks it, pending flag is read after writer count so a finished push is seen
+		if (atomic_load_full(&tmp->remote_writers) != 0 || atomic_load_full(&tmp->remote_pending) != 0) {
+			continue;
+		}
+
+		slab_list_remove(&cachep->slabs_empty, tmp);
+		tmp->next = released;
+		released = tmp;
 		++cnt;
 		cachep->slab_count--;
 	}
 
-	cachep->slabs_empty = NULL;
+	cachep->reclaims += cnt;
+
+	slab_lists_unlock(cachep);
+
+	// no thread can reach unlinked empty slabs
+	while (released) {
+		kmem_slab_t* tmp = released;
+		released = released->next;
+		slab_destruct(cachep, tmp);
+		void* mem = tmp->mem_start;
+		b_set_owner(mem, cachep->slab_blocks, NULL, NULL);
+		b_free(mem, cachep->slab_blocks);
+		if (cachep->off_slab) {
+			kmem_cache_free(&kmem_header->slab_desc_cache, tmp);
+		}
+	}
+
+	return cnt;
+}
+
+void slabs_destroy(kmem_cache_t* cachep)
+{
+	// returns every slab of cache to buddy allocator, cache must already be unregistered
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (cache_lock(cachep) != 0) {
+		return;
+	}
+	//***************************************************************************
+
+	slab_lists_lock(cachep);
+
+	if (cachep->object_count != 0) {
+		printf("WARNING in kmem_cache_destroy: cache %s still has %u objects\n", cachep->name, cachep->object_count);
+	}
+
+	// partial and full slabs are moved to empty list so they are released together
+	for (int list = SLAB_PARTIAL; list <= SLAB_FULL; ++list) {
+		kmem_slab_t** head = slab_list_head(cachep, list);
+		while (*head) {
+			kmem_slab_t* slab = *head;
+			slab_list_remove(head, slab);
+			slab_list_add(&cachep->slabs_empty, slab);
+			slab->list = SLAB_EMPTY;
+		}
+	}
+	cachep->object_count = 0;
+
+	slab_lists_unlock(cachep);
+
+	// slabs that still have remote writers or wait in remote list are released once next drain unlinks them
+	while (cachep->slab_count > 0) {
+		slabs_release(cachep, 0);
+		if (cachep->slab_count > 0) {
+			cpu_relax();
+		}
+	}
+
+	//*****************************mutex signal************************************
+	cache_unlock(cachep);
+	//*****************************************************************************
+
+	if (mutex_destroy(&cachep->cache_mutex) != 0) {
+		printf("Error in destroying mutex for cache: %s\n", cachep->name);
+	}
+}
+
+void kmem_cache_set_reserve(kmem_cache_t* cachep, unsigned slabs)
+{
+	cachep->empty_reserve = slabs;
+}
+
+int cache_reclaim(kmem_cache_t* cachep)
+{
+	// shrinks cache down to its reserve of empty slabs, recently_added is ignored
+	// cache that is locked is skipped so reclaimer never makes allocation paths wait
+	// returns count of deallocated slabs
+
+	//*****************************mutex wait************************************
+	if (mutex_trylock(&cachep->cache_mutex) != 0) {
+		return 0;
+	}
+	//***************************************************************************
+
+	int cnt = slabs_release(cachep, cachep->empty_reserve);
 
 	//*****************************mutex signal************************************
-	if (!ReleaseMutex(cachep->cache_mutex)) {
-		printf("Error in releasing mutex for cache: %s\n", cachep->name);
+	cache_unlock(cachep);
+	//*****************************************************************************
+
+	return cnt;
+}
+
+void reclaim_pass()
+{
+	// shrinks caches in order of last growth, least recently grown first
+	// until free memory is above high watermark or every cache was visited once
+	// list mutex keeps caches from being destroyed during the pass
+
+	//*****************************mutex wait************************************
+	if (mutex_lock(&kmem_header->cache_list_mutex) != 0) {
+		return;
+	}
+	//***************************************************************************
+
+	unsigned long pass = ++kmem_header->reclaim_passes;
+
+	while (b_free_blocks() < kmem_header->reclaim_high) {
+
+		// least recently grown cache that was not visited in this pass and has empty slabs
+		// fields are read without locks as hints, cache_reclaim checks again under list lock
+		kmem_cache_t* victim = NULL;
+		for (kmem_cache_t* curr = kmem_header->cache_head; curr; curr = curr->next) {
+			if (curr->reclaim_pass != pass && curr->slabs_empty &&
+				(!victim || curr->last_grow < victim->last_grow)) {
+				victim = curr;
+			}
+		}
+
+		if (!victim) {
+			break;
+		}
+
+		victim->reclaim_pass = pass;
+		cache_reclaim(victim);
+	}
+
+	//*****************************mutex signal************************************
+	if (mutex_unlock(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error in releasing mutex for list of all caches\n");
+	}
+	//*****************************************************************************
+}
+
+KTHREAD_RETURN reclaim_main(void* arg)
+{
+	(void)arg;
+	while (kmem_header->reclaim_running) {
+		if (b_free_blocks() < kmem_header->reclaim_low) {
+			reclaim_pass();
+		}
+
+		// free chunks of arena zones that are still backed by physical memory are given back to the system
+		b_purge();
+
+		kthread_sleep_ms(kmem_header->reclaim_interval);
+	}
+	return KTHREAD_RETURN_VALUE;
+}
+
+int kmem_reclaim_start(long low_blocks, long high_blocks, unsigned interval_ms)
+{
+	// default watermarks are 1/8 and 1/4 of all memory
+	if (kmem_header->reclaim_running) {
+		return 0;
+	}
+	long total = b_total_blocks();
+	kmem_header->reclaim_low = low_blocks > 0 ? low_blocks : total / 8;
+	kmem_header->reclaim_high = high_blocks > kmem_header->reclaim_low ? high_blocks : kmem_header->reclaim_low + total / 8;
+	kmem_header->reclaim_interval = interval_ms > 0 ? interval_ms : KMEM_RECLAIM_INTERVAL_MS;
+	kmem_header->reclaim_running = 1;
+
+	if (kthread_start(&kmem_header->reclaim_thread, reclaim_main, NULL) != 0) {
+		printf("ERROR in kmem_reclaim_start: reclaimer thread could not be started\n");
+		kmem_header->reclaim_running = 0;
+		return ALLOCATION_ERROR;
+	}
+	return 0;
+}
+
+void kmem_reclaim_stop()
+{
+	if (!kmem_header->reclaim_running) {
+		return;
+	}
+	kmem_header->reclaim_running = 0;
+	kthread_join(kmem_header->reclaim_thread);
+}
+
+void cache_discard(kmem_cache_t* cachep)
+{
+	// undoes init_cache of a cache that was never published and returns it to cache of caches
+	if (mutex_destroy(&cachep->cache_mutex) != 0) {
+		printf("Error in destroying mutex for cache: %s\n", cachep->name);
+	}
+	kmem_cache_free(&kmem_header->cache_of_caches, cachep);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*)){
+
+	// if cache already exists return it
+	kmem_cache_t* found = find_cache(name);
+	if (found) return found;
+
+	// allocate one cache from cache of caches
+	ptr_t free_addr = (ptr_t)kmem_cache_alloc(&kmem_header->cache_of_caches);
+
+	if (!free_addr) {
+		kmem_header->cache_of_caches.error_code = ALLOCATION_ERROR;
+		printf("ERROR in kmem_cache_create: allocation failed\nerror code: %d\n",kmem_header->cache_of_caches.error_code);
+		return NULL;
+	}
+
+	// initialize new cache before it is published
+	kmem_cache_t* new_cache = (kmem_cache_t*)free_addr;
+	init_cache(new_cache, name, size, ctor, dtor);
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (mutex_lock(&kmem_header->cache_list_mutex) != 0) {
+		cache_discard(new_cache);
+		return NULL;
+	}
+	//***************************************************************************
+
+	// other thread may have created cache with the same name in the meantime
+	found = cache_lookup_locked(name);
+	if (!found) {
+		cache_register(new_cache);
+	}
+
+	//*****************************mutex signal************************************
+	if (mutex_unlock(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error in releasing mutex for list of all caches\n");
+	}
+	//*****************************************************************************
+
+	// new cache is not used, existing one is returned
+	if (found) {
+		cache_discard(new_cache);
+		return found;
+	}
+
+	return new_cache;
+}
+
+int extend_cache(kmem_cache_t* cache) {
+
+	// adds one empty slab to cache, cache mutex must be held
+	// slab is built and constructed without list lock and is linked under it at the end
+	// return is error code
+
+	// calculate num of blocks needed for 1 slab and allocate it
+	unsigned block_num = cache->slab_blocks;
+	void* mem = b_alloc(block_num);
+
+	if (!mem) {
+		//buddy allocation failed, error code 1
+		return 1;
+	}
+
+	kmem_slab_t* new_slab = (kmem_slab_t*)mem;
+	ptr_t obj_zone = (ptr_t)mem + sizeof(kmem_slab_t) + 2 * cache->free_map_size;
+
+	if (cache->off_slab) {
+
+		// descriptor and free map are taken from slab-desc cache so objects fill whole slab
+		new_slab = (kmem_slab_t*)kmem_cache_alloc(&kmem_header->slab_desc_cache);
+		if (!new_slab) {
+			b_free(mem, block_num);
+			return 1;
+		}
+		obj_zone = (ptr_t)mem;
+	}
+
+	new_slab->mem_start = mem;
+	spin_init(&new_slab->lock);
+
+	// free map starts after header
+	new_slab->free_slots_map = (map_word_t*)((ptr_t)new_slab + sizeof(kmem_slab_t));
+
+	// remote free map follows free map
+	unsigned words = cache->free_map_size / sizeof(map_word_t);
+	new_slab->remote_free_map = new_slab->free_slots_map + words;
+	new_slab->remote_pending = 0;
+	new_slab->remote_writers = 0;
+	new_slab->remote_next = NULL;
+
+	// initialize free map to al 0 (all free slots), no slot is freed remotely
+	for (unsigned i = 0; i < words; ++i) {
+		new_slab->free_slots_map[i] = 0;
+		new_slab->remote_free_map[i] = 0;
+	}
+
+	// bits after the last slot are marked as used so slot search never takes them
+	for (unsigned i = cache->objects_per_slab; i < words * MAP_WORD_BITS; ++i) {
+		new_slab->free_slots_map[i / MAP_WORD_BITS] |= (map_word_t)1 << (i % MAP_WORD_BITS);
 	}
+
+	new_slab->free_hint = 0;
+
+	// assign next color of cache, colors * color_align never exceeds unused space so last slot stays inside of slab
+	new_slab->color_offset = cache->color_next * cache->color_align;
+	cache->color_next = (cache->color_next + 1 == cache->colors) ? 0 : cache->color_next + 1;
+
+	// objects start after header + free map size + color offset, or at color offset if descriptor is off slab
+	new_slab->obj_start_addr = obj_zone + new_slab->color_offset;
+
+
+	// initialize all objects by calling constructors, or leave it to first hand-out of every slot
+	// caches without constructor treat all slots as constructed
+	new_slab->constructed = 0;
+	if (cache->ctor == NULL) {
+		new_slab->constructed = cache->objects_per_slab;
+	}
+	else if (!cache->lazy_ctor) {
+		slab_construct(cache, new_slab, 0, cache->objects_per_slab);
+		new_slab->constructed = cache->objects_per_slab;
+	}
+
+	// record cache and slab in descriptors of all slab blocks
+	b_set_owner(mem, block_num, cache, new_slab);
+
+	new_slab->inuse = 0;
+	new_slab->in_batch = 0;
+	new_slab->batch_next = NULL;
+
+	cache->last_grow = (unsigned long)atomic_inc(&kmem_header->grow_clock);
+	cache->recently_added = 1;
+
+	// add new slab to empty slabs list and incr cache slab count
+	slab_lists_lock(cache);
+	slab_list_add(&cache->slabs_empty, new_slab);
+	new_slab->list = SLAB_EMPTY;
+	cache->slab_count++;
+	cache->grows++;
+	slab_lists_unlock(cache);
+
+	return 0;
+}
+
+int cache_grow(kmem_cache_t* cachep)
+{
+	// adds a slab when cache has no free slot, growing threads wait for each other on cache mutex
+	// return is error code
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (cache_lock(cachep) != 0) {
+		return ALLOCATION_ERROR;
+	}
+	//***************************************************************************
+
+	// other thread may have added a slab or freed objects while this one waited
+	slab_lists_lock(cachep);
+	slab_drain_remote(cachep);
+	int has_free = cachep->slabs_empty != NULL || slab_fullest_partial(cachep) != NULL;
+	slab_lists_unlock(cachep);
+
+	int ecd = has_free ? 0 : extend_cache(cachep);
+
+	//*****************************mutex signal************************************
+	cache_unlock(cachep);
 	//*****************************************************************************
 
-	return cnt;
+	return ecd;
+}
+
+
+int kmem_cache_shrink(kmem_cache_t* cachep){
+
+	// objects cached in magazines keep their slabs from becoming empty
+	magazine_flush(cachep);
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (cache_lock(cachep) != 0) {
+		return 0;
+	}
+	//***************************************************************************
+
+	if (cachep->recently_added==1) {
+		cachep->recently_added = 0;
+		//*****************************mutex signal************************************
+		cache_unlock(cachep);
+		//*****************************************************************************
+		return 0;
+	}
+
+	// deallocate all empty slabs 
+	// update slab count of cachep
+	// returns count of deallocated slabs
+
+	int cnt = slabs_release(cachep, 0);
+
+	//*****************************mutex signal************************************
+	cache_unlock(cachep);
+	//*****************************************************************************
+
+	return cnt;
+}
+
+unsigned slab_alloc_locked(kmem_cache_t* cachep, unsigned n, void** objs, int count)
+{
+	// takes up to n objects from slab layer, list lock and slab locks are taken inside
+	// slots are reserved under list lock, taken under slab lock and constructed without any lock
+	// count is 1 when objects go to the user, 0 when they go to magazines
+	// return is number of objects taken
+
+	unsigned cnt = 0;
+
+	while (cnt < n) {
+
+		slab_lists_lock(cachep);
+
+		// objects freed by other threads while list lock was held become free slots before new slabs are added
+		slab_drain_remote(cachep);
+
+		// fullest partial slab, or empty one if there is no partial slab
+		kmem_slab_t* slab = slab_pick(cachep);
+
+		// no empty or partial slab is found, must extend the cache
+		if (!slab) {
+
+			slab_lists_unlock(cachep);
+
+			int ecd = cache_grow(cachep);
+
+			if (ecd != 0) {
+
+				// error - cache extension failed
+				printf("ERROR: cache extension failed. error code %d\n", ecd);
+				cachep->error_code = ecd;
+				break;
+			}
+
+			// now 1 empty slab must exist
+			continue;
+		}
+
+		// reserve slots and move slab to partial or full list, so other threads see it with its final fullness
+		unsigned want = cachep->objects_per_slab - slab->inuse;
+		if (want > n - cnt) {
+			want = n - cnt;
+		}
+		slab->inuse += want;
+		cachep->object_count += want;
+		if (cachep->object_count > cachep->high_water) {
+			cachep->high_water = cachep->object_count;
+		}
+		if (count) {
+			cachep->allocs += want;
+		}
+		slab_relink(cachep, slab);
+
+		slab_lists_unlock(cachep);
+
+		// slab lock was taken under list lock, so threads holding list lock never see reserved slots that are not taken
+		unsigned construct_from;
+		unsigned taken = slab_take_slots(cachep, slab, want, objs + cnt, &construct_from);
+		unsigned construct_end = slab->constructed;
+		spin_unlock(&slab->lock);
+
+		// slots handed out for the first time are constructed outside of locks
+		if (cachep->ctor && construct_from < construct_end) {
+			slab_construct(cachep, slab, construct_from, construct_end);
+		}
+
+		cnt += taken;
+
+		// error - reserved slots not found in slab
+		if (taken < want) {
+
+			slab_lists_lock(cachep);
+			slab->inuse -= want - taken;
+			cachep->object_count -= want - taken;
+			if (count) {
+				cachep->allocs -= want - taken;
+			}
+			slab_relink(cachep, slab);
+			cachep->error_code = INCONSISTENT_SLAB_ERROR;
+			slab_lists_unlock(cachep);
+
+			printf("ERROR: kmalloc failed. no free slot found in empty slab. cache %s error code %d\n",cachep->name, cachep->error_code);
+			break;
+		}
+	}
+
+	return cnt;
+}
+
+unsigned slab_free(kmem_cache_t* cachep, unsigned n, void** objs)
+{
+	// returns n objects to slab layer, list lock must be held by caller
+	// free map of every slab is changed under its slab lock, which is kept while objects of the same slab follow each other
+	// every slab that had objects freed changes list at most once, after all objects are freed
+	// return is number of objects freed
+
+	unsigned cnt = 0;
+
+	// slabs touched by this call, linked trough batch_next
+	kmem_slab_t* touched = NULL;
+	kmem_slab_t* locked = NULL;
+
+	for (unsigned i = 0; i < n; ++i) {
+
+		void* objp = objs[i];
+		kmem_slab_t* current_slab = NULL;
+		unsigned slot = 0;
+
+		// check in what slab objects address fall into
+		// address of slab and index of slot are returned trough current_slab and slot arguments
+
+		int result_code = find_containing_slab(cachep, objp, &current_slab, &slot);
+
+		// objects address was not found in the slab 
+		if (result_code == OBJ_NOT_FOUND) {
+			continue;
+		}
+
+		// found , adjust free bit in container slab
+		if (current_slab != locked) {
+			if (locked) {
+				spin_unlock(&locked->lock);
+			}
+			spin_lock(&current_slab->lock);
+			locked = current_slab;
+		}
+
+		// word and mask of the slot in free map
+		unsigned w = slot / MAP_WORD_BITS;
+		map_word_t* free_map = current_slab->free_slots_map + w;
+		map_word_t mask = (map_word_t)1 << (slot % MAP_WORD_BITS);
+
+		// if object is already free print message and skip it
+		if (!(*free_map & mask)) {
+
+			cachep->error_code = DEALLOCATION_ERROR;
+			printf("ERROR: kmem_cache_free: slot is already free.\nerror code: %d\n", cachep->error_code);
+			continue;
+		}
+
+		// switch free bit to 0
+		*free_map &= (~mask);
+		current_slab->inuse--;
+		if (w < current_slab->free_hint) {
+			current_slab->free_hint = w;
+		}
+
+		// decr object count 
+		cachep->object_count--;
+		++cnt;
+
+		// remember slab so it is moved to the right list once
+		if (!current_slab->in_batch) {
+			current_slab->in_batch = 1;
+			current_slab->batch_next = touched;
+			touched = current_slab;
+		}
+	}
+
+	if (locked) {
+		spin_unlock(&locked->lock);
+	}
+
+	// move every touched slab to partial or empty list
+	while (touched) {
+		kmem_slab_t* slab = touched;
+		touched = slab->batch_next;
+		slab->in_batch = 0;
+		slab->batch_next = NULL;
+		slab_relink(cachep, slab);
+	}
+
+	return cnt;
+}
+
+void slab_free_remote(kmem_cache_t* cachep, unsigned n, void** objs, int count)
+{
+	// marks objects as freed in remote free maps of their slabs, without list lock
+	// every slab that gets its first remote free is pushed to remote list of cache with one compare and swap
+
+	long cnt = 0;
+	for (unsigned i = 0; i < n; ++i) {
+
+		kmem_slab_t* slab = NULL;
+		unsigned slot = 0;
+		if (find_containing_slab(cachep, objs[i], &slab, &slot) == OBJ_NOT_FOUND) {
+			continue;
+		}
+
+		// writer count is raised while object still keeps slab from going empty
+		// other thread may merge the bit and empty the slab before this one is done with it, slabs_release skips it until then
+		atomic_add_full(&slab->remote_writers, 1);
+
+		map_word_t mask = (map_word_t)1 << (slot % MAP_WORD_BITS);
+		if (atomic_or64(&slab->remote_free_map[slot / MAP_WORD_BITS], mask) & mask) {
+			printf("ERROR: kmem_cache_free: slot is already free.\nerror code: %d\n", DEALLOCATION_ERROR);
+			atomic_add_full(&slab->remote_writers, -1);
+			continue;
+		}
+		++cnt;
+
+		// bit is set before pending flag is checked, so list lock holder that clears the flag later will see the bit
+		if (atomic_load_full(&slab->remote_pending) == 0 && atomic_xchg(&slab->remote_pending, 1) == 0) {
+			kmem_slab_t* head;
+			do {
+				head = (kmem_slab_t*)atomic_load_ptr((void* volatile*)&cachep->remote_slabs);
+				slab->remote_next = head;
+			} while (!atomic_cas_ptr((void* volatile*)&cachep->remote_slabs, head, slab));
+		}
+
+		atomic_add_full(&slab->remote_writers, -1);
+	}
+
+	atomic_add_full(&cachep->remote_frees, cnt);
+	if (count) {
+		atomic_add_full(&cachep->remote_user_frees, cnt);
+	}
+}
+
+void slab_drain_remote(kmem_cache_t* cachep)
+{
+	// merges remote free maps of all slabs in remote list into their free maps, list lock must be held
+	// every slab changes list at most once
+
+	if (atomic_load_ptr((void* volatile*)&cachep->remote_slabs) == NULL) {
+		return;
+	}
+
+	kmem_slab_t* slab = (kmem_slab_t*)atomic_xchg_ptr((void* volatile*)&cachep->remote_slabs, NULL);
+	unsigned words = cachep->free_map_size / sizeof(map_word_t);
+
+	while (slab) {
+		kmem_slab_t* next = slab->remote_next;
+		slab->remote_next = NULL;
+
+		// flag is cleared before bits are taken, bits set after this push the slab again
+		atomic_xchg(&slab->remote_pending, 0);
+
+		spin_lock(&slab->lock);
+		unsigned freed = 0;
+		for (unsigned w = 0; w < words; ++w) {
+			map_word_t bits = atomic_xchg64(&slab->remote_free_map[w], 0);
+			if (!bits) {
+				continue;
+			}
+
+			// slots that are already free in free map were freed twice
+			if (bits & ~slab->free_slots_map[w]) {
+				cachep->error_code = DEALLOCATION_ERROR;
+				printf("ERROR: kmem_cache_free: slot is already free.\nerror code: %d\n", cachep->error_code);
+				bits &= slab->free_slots_map[w];
+			}
+
+			slab->free_slots_map[w] &= ~bits;
+			freed += bit_popcount64(bits);
+			if (w < slab->free_hint) {
+				slab->free_hint = w;
+			}
+		}
+		spin_unlock(&slab->lock);
+
+		slab->inuse -= freed;
+		cachep->object_count -= freed;
+		slab_relink(cachep, slab);
+
+		slab = next;
+	}
+}
+
+int cache_lock(kmem_cache_t* cachep)
+{
+	// takes cache mutex
+	// return is 0 on success
+	return mutex_lock(&cachep->cache_mutex);
+}
+
+void cache_unlock(kmem_cache_t* cachep)
+{
+	if (mutex_unlock(&cachep->cache_mutex) != 0) {
+		printf("Error in releasing mutex for cache: %s\n", cachep->name);
+	}
+}
+
+void slab_lists_lock(kmem_cache_t* cachep)
+{
+	// takes list lock, counts the wait if it was held by other thread
+	if (spin_trylock(&cachep->list_lock)) {
+		return;
+	}
+	spin_lock(&cachep->list_lock);
+	cachep->contention++;
+}
+
+void slab_lists_unlock(kmem_cache_t* cachep)
+{
+	spin_unlock(&cachep->list_lock);
+}
+
+void slab_free_locked(kmem_cache_t* cachep, unsigned n, void** objs, int count)
+{
+	// returns n objects to slab layer under one list lock
+	// count is 1 when objects come from the user, 0 when they come from magazines
+
+	// list lock is held by other thread, objects are handed to it trough remote free maps instead of waiting
+	if (!spin_trylock(&cachep->list_lock)) {
+		slab_free_remote(cachep, n, objs, count);
+		return;
+	}
+
+	slab_drain_remote(cachep);
+	unsigned freed = slab_free(cachep, n, objs);
+	if (count) {
+		cachep->frees += freed;
+	}
+
+	slab_lists_unlock(cachep);
+}
+
+unsigned kmem_cache_alloc_bulk(kmem_cache_t* cachep, unsigned n, void** objs)
+{
+	return slab_alloc_locked(cachep, n, objs, 1);
+}
+
+void kmem_cache_free_bulk(kmem_cache_t* cachep, unsigned n, void** objs)
+{
+	slab_free_locked(cachep, n, objs, 1);
+}
+
+unsigned magazine_default_size(size_t obj_size)
+{
+	// larger objects get smaller magazines so per-thread slots do not pin too much memory
+	// objects larger than 32KB are not cached in magazines
+	if (obj_size <= 512) return 32;
+	if (obj_size <= 4096) return 16;
+	if (obj_size <= 32768) return 4;
+	return 0;
 }
 
-void* kmem_cache_alloc(kmem_cache_t* cachep)
+int magazine_setup(kmem_cpu_cache_t* cpu)
 {
-	//*****************************mutex wait************************************
-	DWORD wait_result = WaitForSingleObject(cachep->cache_mutex, INFINITE);
-	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
-		return NULL;
+	// gives per-thread slot its loaded and previous magazines on first use
+	// return is 0 if slot has magazines
+
+	kmem_magazine_t* loaded = (kmem_magazine_t*)kmem_cache_alloc(&kmem_header->magazine_cache);
+	kmem_magazine_t* previous = (kmem_magazine_t*)kmem_cache_alloc(&kmem_header->magazine_cache);
+
+	if (loaded && previous) {
+		loaded->rounds = previous->rounds = 0;
+		spin_lock(&cpu->lock);
+		if (!cpu->loaded) {
+			cpu->loaded = loaded;
+			cpu->previous = previous;
+			loaded = previous = NULL;
+		}
+		spin_unlock(&cpu->lock);
 	}
-	//***************************************************************************
-
-	void* free_addr = NULL;
 
-	// try to find free slot in partial or empty slab
-	// if free slot is found address of slot is returned through free_addr argument
-	// if free slot is found this function will adjust its bit to not free (1)
-	int result_code = get_free_slot(cachep, &free_addr);
-	
-	// no empty or partial slab is found, must extend the cache
-	if (result_code==SLOT_NOT_FOUND) {
+	// other thread has set up the slot first or allocation failed
+	if (loaded) kmem_cache_free(&kmem_header->magazine_cache, loaded);
+	if (previous) kmem_cache_free(&kmem_header->magazine_cache, previous);
 
-		int ecd = extend_cache(cachep);
+	return cpu->loaded ? 0 : ALLOCATION_ERROR;
+}
 
-		if (ecd != 0) {
+void* magazine_alloc(kmem_cache_t* cachep)
+{
+	// returns object from per-thread magazines, refills them from slab layer when they run out
+	// NULL means magazine layer can not be used and caller should go to slab layer
 
-			// error - cache extension failed
-			printf("ERROR: cache extension failed. error code %d\n", ecd);
-			cachep->error_code = ecd;
+	kmem_cpu_cache_t* cpu = &cachep->cpu_caches[thread_slot() % KMEM_CPU_NUM];
+	if (!cpu->loaded && magazine_setup(cpu) != 0) {
+		return NULL;
+	}
 
-			//*****************************mutex signal************************************
-			if (!ReleaseMutex(cachep->cache_mutex)) {
-				printf("Error in releasing mutex for cache: %s\n", cachep->name);
-			}
-			//*****************************************************************************
+	void* objp = NULL;
 
-			return NULL;
-		}
+	spin_lock(&cpu->lock);
 
-		// call get_free_slot again, now 1 emtpy slab must exist
-		result_code = get_free_slot(cachep, &free_addr);
+	// magazines were flushed in the meantime
+	if (!cpu->loaded) {
+		spin_unlock(&cpu->lock);
+		return NULL;
 	}
 
-	// incr object count and update used_pct
-	cachep->object_count++;
-
-	// found free slot in partial slab
-	if (result_code == SLOT_FOUND_PARTIAL) {
+	// loaded is empty and previous is not, exchange them
+	if (cpu->loaded->rounds == 0 && cpu->previous->rounds > 0) {
+		kmem_magazine_t* tmp = cpu->loaded;
+		cpu->loaded = cpu->previous;
+		cpu->previous = tmp;
+	}
 
-		// if partial slab is now full move it to full list
-		if (partial_slab_full(cachep)) {
-			move_partial_full(cachep);
+	// both are empty, exchange previous for a full magazine from depot
+	if (cpu->loaded->rounds == 0) {
+		spin_lock(&cachep->depot_lock);
+		if (cachep->depot_full) {
+			kmem_magazine_t* full = cachep->depot_full;
+			cachep->depot_full = full->next;
+			cpu->previous->next = cachep->depot_empty;
+			cachep->depot_empty = cpu->previous;
+			cpu->previous = cpu->loaded;
+			cpu->loaded = full;
 		}
+		spin_unlock(&cachep->depot_lock);
+	}
 
+	if (cpu->loaded->rounds > 0) {
+		objp = cpu->loaded->objs[--cpu->loaded->rounds];
+		cpu->allocs++;
 	}
 
-	// found free slot in empty slab
-	else if (result_code == SLOT_FOUND_EMPTY) {
+	spin_unlock(&cpu->lock);
 
-		// empty slab is now partial move it to partial list
-		move_empty_partial(cachep);
-		// if partial slab is now full move it to full list
-		if (partial_slab_full(cachep)) {
-			move_partial_full(cachep);
-		}
+	if (objp) {
+		return objp;
+	}
 
+	// magazines and depot are empty, take a magazine worth of objects from slab layer in bulk
+	void* objs[MAGAZINE_SIZE_MAX];
+	unsigned n = slab_alloc_locked(cachep, cachep->magazine_size, objs, 0);
+	if (n == 0) {
+		return NULL;
 	}
 
-	// error - free slot not found even when new empty slab was created
-	else if (result_code == SLOT_NOT_FOUND) {
+	// last one is returned, others are loaded into magazines
+	objp = objs[--n];
 
-		cachep->error_code = INCONSISTENT_SLAB_ERROR;
-		printf("ERROR: kmalloc failed. no free slot found in empty slab. cache %s error code %d\n",cachep->name, cachep->error_code);
+	spin_lock(&cpu->lock);
+	cpu->allocs++;
+	while (cpu->loaded && n > 0 && cpu->loaded->rounds < cachep->magazine_size) {
+		cpu->loaded->objs[cpu->loaded->rounds++] = objs[--n];
 	}
-	
-	//*****************************mutex signal************************************
-	if (!ReleaseMutex(cachep->cache_mutex)) {
-		printf("Error in releasing mutex for cache: %s\n", cachep->name);
+	while (cpu->previous && n > 0 && cpu->previous->rounds < cachep->magazine_size) {
+		cpu->previous->objs[cpu->previous->rounds++] = objs[--n];
 	}
-	//*****************************************************************************
+	spin_unlock(&cpu->lock);
 
-	// return address of the object
-	return free_addr;
+	// other threads on this slot filled or flushed magazines in the meantime
+	if (n > 0) {
+		slab_free_locked(cachep, n, objs, 0);
+	}
+
+	return objp;
 }
 
-void kmem_cache_free(kmem_cache_t* cachep, void* objp)
+int magazine_holds(kmem_magazine_t* mag, void* objp)
 {
-	//*****************************mutex wait************************************
-	DWORD wait_result = WaitForSingleObject(cachep->cache_mutex, INFINITE);
-	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
-		return;
+	// 1 if object is one of the rounds of magazine, lock of its per-thread slot must be held
+	for (unsigned i = 0; i < mag->rounds; ++i) {
+		if (mag->objs[i] == objp) {
+			return 1;
+		}
 	}
-	//***************************************************************************
-
-	kmem_slab_t* current_slab = NULL;
+	return 0;
+}
 
-	// check in what slab objects address fall into
-	// address of slab is returned trough current_slab argument
+int magazine_free(kmem_cache_t* cachep, void* objp)
+{
+	// puts object into per-thread magazines
+	// return is 0 if object is taken by magazine layer or rejected as double free
 
-	int result_code = find_containing_slab(cachep, objp, &current_slab);
+	kmem_cpu_cache_t* cpu = &cachep->cpu_caches[thread_slot() % KMEM_CPU_NUM];
+	if (!cpu->loaded && magazine_setup(cpu) != 0) {
+		return ALLOCATION_ERROR;
+	}
 
-	
-	// found , adjust free bit in container slab
-	if (result_code!=OBJ_NOT_FOUND) {
+	// only start of an object in a slab of this cache can get into magazines
+	kmem_slab_t* slab;
+	unsigned slot;
+	if (find_containing_slab(cachep, objp, &slab, &slot) == OBJ_NOT_FOUND) {
+		return DEALLOCATION_ERROR;
+	}
 
-		octet* free_map = current_slab->free_slots_map;
+	// object that is already free in its slab is left to slab layer, which reports it
+	// only this thread owns the object, so its bits do not change under the read
+	unsigned w = slot / MAP_WORD_BITS;
+	map_word_t mask = (map_word_t)1 << (slot % MAP_WORD_BITS);
+	if (!(((volatile map_word_t*)slab->free_slots_map)[w] & mask) || (slab->remote_free_map[w] & mask)) {
+		return DEALLOCATION_ERROR;
+	}
 
-		for (int i = 0; i < cachep->objects_per_slab; ++i)
-		{
-			// after every 8 slots move to next octet in free map
-			if ((i % BITS_PER_BYTE == 0) && (i != 0))
-				++free_map;
+	// second attempt is made after a new empty magazine is added to depot
+	for (int attempt = 0; attempt < 2; ++attempt) {
 
-			// calculate address of next slot
-			ptr_t addr = (ptr_t)current_slab->obj_start_addr + i * cachep->obj_size;
+		int done = 0;
 
-			// prepare mask for checking if object is free
-			unsigned shift = (BITS_PER_BYTE - (i % BITS_PER_BYTE) - 1);
-			octet mask = 1 << shift;
+		spin_lock(&cpu->lock);
 
-			// found the object
-			if (addr == objp) {
+		// magazines were flushed in the meantime
+		if (!cpu->loaded) {
+			spin_unlock(&cpu->lock);
+			return ALLOCATION_ERROR;
+		}
 
-				// if object is already free print message and exit
-				if (!(*free_map & mask)) {
+		// object freed twice to this thread is still marked used in its slab, slab layer can not catch it
+		if (magazine_holds(cpu->loaded, objp) || magazine_holds(cpu->previous, objp)) {
+			spin_unlock(&cpu->lock);
+			cachep->error_code = DEALLOCATION_ERROR;
+			printf("ERROR: kmem_cache_free: slot is already free.\nerror code: %d\n", cachep->error_code);
+			return 0;
+		}
 
-					cachep->error_code = DEALLOCATION_ERROR;
-					printf("ERROR: kmem_cache_free: slot is already free.\nerror code: %d\n", cachep->error_code);
+		// loaded is full and previous is not, exchange them
+		if (cpu->loaded->rounds >= cachep->magazine_size && cpu->previous->rounds < cachep->magazine_size) {
+			kmem_magazine_t* tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+		}
 
-					//*****************************mutex signal************************************
-					if (!ReleaseMutex(cachep->cache_mutex)) {
-						printf("Error in releasing mutex for cache: %s\n", cachep->name);
-					}
-					//*****************************************************************************
+		// both are full, exchange previous for an empty magazine from depot
+		if (cpu->loaded->rounds >= cachep->magazine_size) {
+			spin_lock(&cachep->depot_lock);
+			if (cachep->depot_empty) {
+				kmem_magazine_t* empty = cachep->depot_empty;
+				cachep->depot_empty = empty->next;
+				cpu->previous->next = cachep->depot_full;
+				cachep->depot_full = cpu->previous;
+				cpu->previous = cpu->loaded;
+				cpu->loaded = empty;
+			}
+			spin_unlock(&cachep->depot_lock);
+		}
 
-					return;
-				}
+		if (cpu->loaded->rounds < cachep->magazine_size) {
+			cpu->loaded->objs[cpu->loaded->rounds++] = objp;
+			cpu->frees++;
+			done = 1;
+		}
 
-				// call destructor if defines
-				if (cachep->ctor != NULL)
-					cachep->ctor(addr);
+		spin_unlock(&cpu->lock);
 
-				/*// call constructor if defined
-				if (cachep->ctor != NULL)
-					cachep->ctor(addr);*/
+		if (done) {
+			return 0;
+		}
 
-				// switch free bit to 0
-				// to kill bit 2 mask is ~(1<<(8-2-1)) = 11011111
-				*free_map &= (~mask);
+		// depot has no empty magazines, add a new one
+		kmem_magazine_t* empty = (kmem_magazine_t*)kmem_cache_alloc(&kmem_header->magazine_cache);
+		if (!empty) {
+			break;
+		}
+		empty->rounds = 0;
+		spin_lock(&cachep->depot_lock);
+		empty->next = cachep->depot_empty;
+		cachep->depot_empty = empty;
+		spin_unlock(&cachep->depot_lock);
+	}
 
-				// decr object count 
-				cachep->object_count--;
+	return ALLOCATION_ERROR;
+}
 
-				// if object was in full slab that slab is now partial
-				if (result_code == OBJ_FOUND_FULL) {
-					move_full_partial(cachep, current_slab);
-				}
+void magazine_flush(kmem_cache_t* cachep)
+{
+	// returns all objects from magazines and depot to slab layer
+	// and all magazines to magazine cache
+
+	kmem_magazine_t* list = NULL;
+
+	// detach magazines from every per-thread slot, slot gets new ones on next use
+	for (int i = 0; i < KMEM_CPU_NUM; ++i) {
+		kmem_cpu_cache_t* cpu = &cachep->cpu_caches[i];
+		spin_lock(&cpu->lock);
+		if (cpu->loaded) {
+			cpu->loaded->next = cpu->previous;
+			cpu->previous->next = list;
+			list = cpu->loaded;
+			cpu->loaded = cpu->previous = NULL;
+		}
+		spin_unlock(&cpu->lock);
+	}
 
-				// if that slab became empty move it to empty list
-				if (slab_empty(cachep, current_slab))
-				{
-					move_partial_empty(cachep, current_slab);
-				}
+	// detach depot
+	spin_lock(&cachep->depot_lock);
+	kmem_magazine_t* full = cachep->depot_full;
+	kmem_magazine_t* empty = cachep->depot_empty;
+	cachep->depot_full = cachep->depot_empty = NULL;
+	spin_unlock(&cachep->depot_lock);
+
+	kmem_magazine_t* lists[3] = { list, full, empty };
+	for (int i = 0; i < 3; ++i) {
+		kmem_magazine_t* mag = lists[i];
+		while (mag) {
+			kmem_magazine_t* next = mag->next;
+			if (mag->rounds > 0) {
+				slab_free_locked(cachep, mag->rounds, mag->objs, 0);
+			}
+			kmem_cache_free(&kmem_header->magazine_cache, mag);
+			mag = next;
+		}
+	}
+}
 
-				//*****************************mutex signal************************************
-				if (!ReleaseMutex(cachep->cache_mutex)) {
-					printf("Error in releasing mutex for cache: %s\n", cachep->name);
-				}
-				//*****************************************************************************
+void* kmem_cache_alloc(kmem_cache_t* cachep)
+{
+	void* objp = NULL;
 
-				return;
-			}
+	// common case is served from per-thread magazines without taking cache locks
+	if (cachep->magazine_size > 0) {
+		objp = magazine_alloc(cachep);
+	}
 
-			
-		}
+	if (!objp) {
+		slab_alloc_locked(cachep, 1, &objp, 1);
 	}
 
-	/*else {
-		// objects address was not found in the slab 
-		cachep->error_code = 3;
-		//printf("ERROR in kmem_cache_free: object's address not found in the slab\nerror code: %d\n", cachep->error_code);
-	}*/
+	// return address of the object
+	return objp;
 }
 
-void* kmalloc(size_t size)
+void kmem_cache_free(kmem_cache_t* cachep, void* objp)
 {
-	// size must be rounded to closest higher power of 2 
-	size = closest_higher_pow2(size);
+	// common case is put into per-thread magazines without taking cache locks
+	if (cachep->magazine_size > 0 && magazine_free(cachep, objp) == 0) {
+		return;
+	}
 
-	// small_buffers[i] is size 2 ^ i
-	int small_buff_index = log2(size);
+	slab_free_locked(cachep, 1, &objp, 1);
+}
 
-	// small buffer size must be 2^5 - 2^17
-	if (small_buff_index < 5 || small_buff_index > 17) {
-		printf("ERROR in kmalloc: small buffer in that size does not exist.\n");
-		return NULL;
+int kmem_cache_set_magazine_size(kmem_cache_t* cachep, unsigned size)
+{
+	if (size > MAGAZINE_SIZE_MAX) {
+		printf("ERROR in kmem_cache_set_magazine_size: max magazine size is %d\n", MAGAZINE_SIZE_MAX);
+		return ALLOCATION_ERROR;
 	}
 
-	//*****************************mutex wait****************************************
-	DWORD wait_result = WaitForSingleObject(kmem_header->small_buffer_caches[small_buff_index].cache_mutex, INFINITE);
-	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
-		return;
+	// magazines are always allocated with MAGAZINE_SIZE_MAX slots so size can change at any time
+	// objects above new size are returned to slab layer when magazine is drained
+	cachep->magazine_size = size;
+	if (size == 0) {
+		magazine_flush(cachep);
+	}
+	return 0;
+}
+
+void* kmalloc(size_t size)
+{
+	// buffers above largest small buffer are whole power of 2 block runs from buddy allocator
+	if (size > POW2(SMALL_BUFFER_UPPER_LIMIT)) {
+		return kmalloc_large(size);
 	}
-	//*******************************************************************************
 
+	// size is rounded to closest higher size class
+	// common small sizes are looked up in table, others are computed from highest bit
+	unsigned small_buff_index = (size <= SMALL_BUFFER_TABLE_MAX)
+		? kmem_header->small_buffer_table[(size + POW2(SMALL_BUFFER_TABLE_SHIFT) - 1) >> SMALL_BUFFER_TABLE_SHIFT]
+		: small_buffer_class(size);
+
+	// cache locks are taken inside kmem_cache_alloc
 	void* addr = kmem_cache_alloc(&(kmem_header->small_buffer_caches[small_buff_index]));
 	if (!addr) {
 		printf("ERROR in kmalloc: allocation failed\nerror code: %d\n", kmem_header->small_buffer_caches[small_buff_index].error_code);
 	}
-	//*****************************mutex signal************************************
-	if (!ReleaseMutex(kmem_header->small_buffer_caches[small_buff_index].cache_mutex)) {
-		printf("Error in releasing mutex for cache: %s\n", kmem_header->small_buffer_caches[small_buff_index].name);
+	return addr;
+}
+
+unsigned small_buffer_class(size_t size)
+{
+	// index of smallest size class that can hold size bytes
+	// band (2^k, 2^(k+1)] is split into 2^SMALL_BUFFER_CLASS_BITS classes of equal step
+	if (size <= POW2(SMALL_BUFFER_LOWER_LIMIT)) {
+		return 0;
 	}
-	//*****************************************************************************
+
+	size_t x = size - 1;
+	int k = closest_lower_log2(x);
+	unsigned step = (unsigned)(x >> (k - SMALL_BUFFER_CLASS_BITS)) & (POW2(SMALL_BUFFER_CLASS_BITS) - 1);
+	return 1 + ((k - SMALL_BUFFER_LOWER_LIMIT) << SMALL_BUFFER_CLASS_BITS) + step;
+}
+
+size_t small_buffer_class_size(unsigned index)
+{
+	// inverse of small_buffer_class, size in bytes of class with given index
+	if (index == 0) {
+		return POW2(SMALL_BUFFER_LOWER_LIMIT);
+	}
+
+	int k = SMALL_BUFFER_LOWER_LIMIT + ((index - 1) >> SMALL_BUFFER_CLASS_BITS);
+	size_t step = (index - 1) & (POW2(SMALL_BUFFER_CLASS_BITS) - 1);
+	return POW2(k) + ((step + 1) << (k - SMALL_BUFFER_CLASS_BITS));
+}
+
+void* kmalloc_large(size_t size)
+{
+	// sizes above largest buddy block are rejected before rounding, so block count can not wrap
+	if (size > (size_t)POW2(LARGE_BUFFER_MAX_ORDER) * BLOCK_SIZE) {
+		printf("ERROR in kmalloc: size %zu is larger than largest memory buffer\n", size);
+		return NULL;
+	}
+
+	// size is rounded to power of 2 number of blocks
+	size_t blocks = div_round_up(size, BLOCK_SIZE);
+	int order = closest_higher_log2(blocks);
+
+	void* addr = b_alloc((int)POW2(order));
+	if (!addr) {
+		printf("ERROR in kmalloc: allocation of %d blocks failed\n", (int)POW2(order));
+		return NULL;
+	}
+
+	// first block records the order so kfree can release it without size
+	b_page_desc(addr)->large_order = order;
 	return addr;
 }
 
+void kfree_large(const void* objp)
+{
+	// only the start of large buffer has its order recorded
+	// pointer must be at the block boundary, else it points inside of the buffer
+	if (b_block_start(objp) != objp) {
+		printf("ERROR in kfree: address is not the start of a memory buffer\n");
+		return;
+	}
+
+	page_desc_t* page = b_page_desc(objp);
+	int order = page->large_order;
+	page->large_order = -1;
+	b_free((void*)objp, (int)POW2(order));
+}
+
 void kfree(const void* objp)
 {
+	if (!objp) {
+		return;
+	}
 
-	// iterate trough all small buffer caches and call kmem_cache_free
+	// owning cache is recorded in descriptor of the block that contains the buffer
+	page_desc_t* page = b_page_desc(objp);
+	kmem_cache_t* cachep = page ? (kmem_cache_t*)page->cache : NULL;
 
-	for (int i = SMALL_BUFFER_LOWER_LIMIT; i <= SMALL_BUFFER_UPPER_LIMIT; ++i) {
-		kmem_cache_t* current_cache = &(kmem_header->small_buffer_caches[i]);
-		int num_of_objs = kmem_header->small_buffer_caches[i].object_count;
-		kmem_cache_free(&(kmem_header->small_buffer_caches[i]), (void*)objp);
+	// large buffers have no cache, their order is recorded in descriptor of the first block
+	if (page && !cachep && page->large_order >= 0) {
+		kfree_large(objp);
+		return;
+	}
 
-		// if free succeded then leave loop
-		if (num_of_objs == kmem_header->small_buffer_caches[i].object_count + 1)
-			break;
+	// buffer must belong to one of small buffer caches
+	if (cachep < &kmem_header->small_buffer_caches[0] ||
+		cachep > &kmem_header->small_buffer_caches[SMALL_BUFFER_NUM - 1]) {
+		printf("ERROR in kfree: address is not a kmalloc memory buffer\n");
+		return;
 	}
 
+	kmem_cache_free(cachep, (void*)objp);
 }
 
 void kmem_cache_destroy(kmem_cache_t* cachep)
@@ -767,34 +2060,34 @@ void kmem_cache_destroy(kmem_cache_t* cachep)
 	//*****************************mutex wait****************************************
 	// this wait is on mutex for list of caches
 	// wait on caches mutex will be done in kmem_cache_free call
-	DWORD wait_result = WaitForSingleObject(kmem_header->cache_list_mutex, INFINITE);
 	// could not get mutex
-	if (wait_result != WAIT_OBJECT_0) {
+	if (mutex_lock(&kmem_header->cache_list_mutex) != 0) {
 		return;
 	}
 	//*******************************************************************************
 
-	// remove cache from list of caches
-	kmem_cache_t* curr = kmem_header->cache_head, * prev = NULL;
-	while (curr && curr != cachep) {
-		prev = curr;
-		curr = curr->next;
-	}
-	if (!curr)
-		return;
-	if (curr == kmem_header->cache_head) {
-		kmem_header->cache_head = curr->next;
-	}
-	else {
-		prev->next = curr->next;
-	}
+	// only caches that are in the list of caches can be destroyed
+	// cache is found by address, so fields of a cache that was already destroyed are not read
+	int found = cache_unregister(cachep);
 
 	//*****************************mutex signal************************************
-	if (!ReleaseMutex(kmem_header->cache_list_mutex)) {
-		printf("Error in releasing mutex for cache: %s\n", cachep->name);
+	if (mutex_unlock(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error in releasing mutex for list of all caches\n");
 	}
 	//*****************************************************************************
 
+	if (!found) {
+		return;
+	}
+
+	// lock-free readers that found the cache before it was removed must finish before its memory is reused
+	registry_wait_readers();
+
+	// return objects held in magazines before cache memory is reused
+	magazine_flush(cachep);
+
+	// all slabs go back to buddy allocator, objects that were not freed are lost
+	slabs_destroy(cachep);
 
 	// deallocate it from cache of caches
 	kmem_cache_free(&(kmem_header->cache_of_caches), cachep);
@@ -802,19 +2095,310 @@ void kmem_cache_destroy(kmem_cache_t* cachep)
 
 void kmem_cache_info(kmem_cache_t* cachep)
 {	
-	WaitForSingleObject(kmem_header->cache_of_caches.cache_mutex, INFINITE);
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cachep, &stats);
+
 	printf("\n");
-	printf("Cache name: %s\n", cachep->name);
-	printf("Object size: %dB\n", cachep->obj_size);
-	printf("Cache size: %d blocks\n", total_cache_blocks(cachep));
-	printf("Number of slabs: %d\n", cachep->slab_count);
-	printf("Number of objects per slab: %d\n", cachep->objects_per_slab);
-	int used_pct = (cachep->slab_count==0) ? 0: 100 * (double)(cachep->object_count) / (double)(cachep->slab_count * cachep->objects_per_slab);
-	printf("Fullnes %: %d%%\n", used_pct );
-	ReleaseMutex(kmem_header->cache_of_caches.cache_mutex);
+	printf("Cache name: %s\n", stats.name);
+	printf("Object size: %uB\n", (unsigned)stats.obj_size);
+	printf("Cache size: %u blocks\n", total_cache_blocks(cachep));
+	printf("Number of slabs: %u\n", stats.slab_count);
+	printf("Number of objects per slab: %u\n", stats.objects_per_slab);
+	int used_pct = (stats.total_objs == 0) ? 0 : (int)(100.0 * stats.active_objs / stats.total_objs);
+	printf("Fullnes %%: %d%%\n", used_pct );
 	printf("\n");
 }
 
+void kmem_cache_stats(kmem_cache_t* cachep, kmem_cache_stats_t* stats)
+{
+	// slab state is read under list lock so all values belong to the same moment
+	slab_lists_lock(cachep);
+
+	// objects freed remotely are counted as free
+	slab_drain_remote(cachep);
+
+	strcpy(stats->name, cachep->name);
+	stats->obj_size = cachep->obj_size;
+	stats->objects_per_slab = cachep->objects_per_slab;
+	stats->slab_blocks = cachep->slab_blocks;
+	stats->slab_count = cachep->slab_count;
+	stats->total_objs = cachep->slab_count * cachep->objects_per_slab;
+	stats->active_objs = cachep->object_count;
+	stats->high_water = cachep->high_water;
+	stats->grows = cachep->grows;
+	stats->reclaims = cachep->reclaims;
+	stats->contention = cachep->contention;
+	stats->allocs = cachep->allocs;
+	stats->frees = cachep->frees;
+	stats->wasted_bytes = cachep->unused_space * cachep->slab_count;
+	stats->magazine_size = cachep->magazine_size;
+	stats->colors = cachep->colors;
+	stats->remote_frees = (unsigned long)atomic_load_full(&cachep->remote_frees);
+	stats->frees += (unsigned long)atomic_load_full(&cachep->remote_user_frees);
+
+	// full slabs are not walked, they have no free slots
+	stats->empty_slabs = 0;
+	stats->partial_slabs = 0;
+	stats->partial_free_objs = 0;
+	for (int list = SLAB_EMPTY; list < SLAB_FULL; ++list) {
+		for (kmem_slab_t* slab = *slab_list_head(cachep, list); slab; slab = slab->next) {
+			if (list == SLAB_EMPTY) {
+				stats->empty_slabs++;
+			}
+			else {
+				stats->partial_slabs++;
+				stats->partial_free_objs += cachep->objects_per_slab - slab->inuse;
+			}
+		}
+	}
+
+	slab_lists_unlock(cachep);
+
+	// magazine counters of every slot are read under slot lock
+	for (int i = 0; i < KMEM_CPU_NUM; ++i) {
+		kmem_cpu_cache_t* cpu = &cachep->cpu_caches[i];
+		spin_lock(&cpu->lock);
+		stats->allocs += cpu->allocs;
+		stats->frees += cpu->frees;
+		spin_unlock(&cpu->lock);
+	}
+}
+
+void kmem_slabinfo(FILE* out)
+{
+	// one line for every cache, columns are described in the first two lines
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (mutex_lock(&kmem_header->cache_list_mutex) != 0) {
+		return;
+	}
+	//***************************************************************************
+
+	fprintf(out, "slabinfo - version: 2.1 (kmem)\n");
+	fprintf(out, "# name            <active_objs> <num_objs> <objsize> <objperslab> <pagesperslab>"
+		" : stats <allocs> <frees> <high_water> <grows> <reclaims> <contention>"
+		" : slabdata <num_slabs> <wasted_bytes> <magazine_size>\n");
+
+	kmem_cache_t* curr = kmem_header->cache_head;
+	while (curr) {
+		kmem_cache_stats_t stats;
+		kmem_cache_stats(curr, &stats);
+		fprintf(out, "%-17s %13u %10u %9u %12u %14u : stats %8lu %7lu %12u %7lu %10lu %12lu : slabdata %11u %14u %15u\n",
+			stats.name, stats.active_objs, stats.total_objs, (unsigned)stats.obj_size, stats.objects_per_slab, stats.slab_blocks,
+			stats.allocs, stats.frees, stats.high_water, stats.grows, stats.reclaims, stats.contention,
+			stats.slab_count, (unsigned)stats.wasted_bytes, stats.magazine_size);
+		curr = curr->next;
+	}
+
+	//*****************************mutex signal************************************
+	if (mutex_unlock(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error in releasing mutex for list of all caches\n");
+	}
+	//*****************************************************************************
+}
+
+int cache_check_magazine(kmem_cache_t* cachep, kmem_magazine_t* mag, unsigned* objects)
+{
+	// objects in magazine must be taken from slabs of this cache, list lock must be held
+	// returns number of problems found
+	int errors = 0;
+
+	if (mag->rounds > MAGAZINE_SIZE_MAX) {
+		printf("ERROR in kmem_check_consistency: cache %s has magazine with %u rounds\n", cachep->name, mag->rounds);
+		return 1;
+	}
+
+	for (unsigned i = 0; i < mag->rounds; ++i) {
+		kmem_slab_t* slab = NULL;
+		unsigned slot = 0;
+		if (find_containing_slab(cachep, mag->objs[i], &slab, &slot) == OBJ_NOT_FOUND) {
+			printf("ERROR in kmem_check_consistency: cache %s has object in magazine that is not in its slabs\n", cachep->name);
+			errors++;
+			continue;
+		}
+		spin_lock(&slab->lock);
+		if (!(slab->free_slots_map[slot / MAP_WORD_BITS] & ((map_word_t)1 << (slot % MAP_WORD_BITS)))) {
+			printf("ERROR in kmem_check_consistency: cache %s has object in magazine that is marked free in its slab\n", cachep->name);
+			errors++;
+		}
+		spin_unlock(&slab->lock);
+	}
+
+	*objects += mag->rounds;
+	return errors;
+}
+
+int cache_check(kmem_cache_t* cachep)
+{
+	// validates slab lists, free maps and counters of cache, prints every problem found
+	// returns number of problems found
+	int errors = 0;
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (cache_lock(cachep) != 0) {
+		return 0;
+	}
+	//***************************************************************************
+
+	// list lock stops allocation and free paths, slots reserved under it are taken before it is released
+	slab_lists_lock(cachep);
+
+	// remote frees are merged first, so counters and free maps describe the same state
+	slab_drain_remote(cachep);
+
+	unsigned slabs = 0;
+	unsigned inuse = 0;
+	unsigned words = cachep->free_map_size / sizeof(map_word_t);
+
+	for (int list = SLAB_EMPTY; list <= SLAB_FULL; ++list) {
+		kmem_slab_t* prev = NULL;
+		for (kmem_slab_t* slab = *slab_list_head(cachep, list); slab; prev = slab, slab = slab->next) {
+			slabs++;
+			inuse += slab->inuse;
+
+			if (slab->list != list || slab->prev != prev) {
+				printf("ERROR in kmem_check_consistency: cache %s has slab with wrong list links\n", cachep->name);
+				errors++;
+			}
+
+			spin_lock(&slab->lock);
+
+			// used slots in free map, bits after last slot are always set
+			unsigned used = 0;
+			for (unsigned w = 0; w < words; ++w) {
+				map_word_t word = slab->free_slots_map[w];
+				used += bit_popcount64(word);
+				if (w < slab->free_hint && word != MAP_WORD_FULL) {
+					printf("ERROR in kmem_check_consistency: cache %s has slab with free slot before free_hint\n", cachep->name);
+					errors++;
+				}
+			}
+			for (unsigned i = cachep->objects_per_slab; i < words * MAP_WORD_BITS; ++i) {
+				if (!(slab->free_slots_map[i / MAP_WORD_BITS] & ((map_word_t)1 << (i % MAP_WORD_BITS)))) {
+					printf("ERROR in kmem_check_consistency: cache %s has slab with free bit past last slot\n", cachep->name);
+					errors++;
+					break;
+				}
+				used--;
+			}
+
+			// slots past constructed ones were never handed out
+			for (unsigned i = slab->constructed; i < cachep->objects_per_slab; ++i) {
+				if (slab->free_slots_map[i / MAP_WORD_BITS] & ((map_word_t)1 << (i % MAP_WORD_BITS))) {
+					printf("ERROR in kmem_check_consistency: cache %s has slab with used slot that was never constructed\n", cachep->name);
+					errors++;
+					break;
+				}
+			}
+
+			if (used != slab->inuse) {
+				printf("ERROR in kmem_check_consistency: cache %s has slab with %u used slots in free map, inuse is %u\n", cachep->name, used, slab->inuse);
+				errors++;
+			}
+
+			spin_unlock(&slab->lock);
+
+			// slab must be in the list that matches its fullness
+			int expected = slab_list_id(cachep, slab->inuse);
+			if (expected != list) {
+				printf("ERROR in kmem_check_consistency: cache %s has slab with %u used slots in list %d\n", cachep->name, slab->inuse, list);
+				errors++;
+			}
+
+			// colored object area must end inside of slab
+			if ((ptr_t)slab->obj_start_addr + (size_t)cachep->objects_per_slab * cachep->obj_size >
+				(ptr_t)slab->mem_start + (size_t)cachep->slab_blocks * BLOCK_SIZE) {
+				printf("ERROR in kmem_check_consistency: cache %s has slab with color offset %u past unused space\n", cachep->name, slab->color_offset);
+				errors++;
+			}
+
+			// every block of slab must record this cache and slab as owner
+			for (unsigned b = 0; b < cachep->slab_blocks; ++b) {
+				page_desc_t* page = b_page_desc((block_ptr_t)slab->mem_start + b);
+				if (!page || page->cache != cachep || page->slab != slab) {
+					printf("ERROR in kmem_check_consistency: cache %s has slab block with wrong owner\n", cachep->name);
+					errors++;
+					break;
+				}
+			}
+		}
+	}
+
+	if (slabs != cachep->slab_count) {
+		printf("ERROR in kmem_check_consistency: cache %s has %u slabs in lists, slab_count is %u\n", cachep->name, slabs, cachep->slab_count);
+		errors++;
+	}
+	if (inuse != cachep->object_count) {
+		printf("ERROR in kmem_check_consistency: cache %s has %u used slots, object_count is %u\n", cachep->name, inuse, cachep->object_count);
+		errors++;
+	}
+
+	// objects cached in magazines and depot are counted as used by slab layer
+	unsigned cached = 0;
+	for (int i = 0; i < KMEM_CPU_NUM; ++i) {
+		kmem_cpu_cache_t* cpu = &cachep->cpu_caches[i];
+		spin_lock(&cpu->lock);
+		if (cpu->loaded) {
+			errors += cache_check_magazine(cachep, cpu->loaded, &cached);
+			errors += cache_check_magazine(cachep, cpu->previous, &cached);
+		}
+		spin_unlock(&cpu->lock);
+	}
+	spin_lock(&cachep->depot_lock);
+	for (kmem_magazine_t* mag = cachep->depot_full; mag; mag = mag->next) {
+		errors += cache_check_magazine(cachep, mag, &cached);
+	}
+	for (kmem_magazine_t* mag = cachep->depot_empty; mag; mag = mag->next) {
+		errors += cache_check_magazine(cachep, mag, &cached);
+	}
+	spin_unlock(&cachep->depot_lock);
+
+	if (cached > cachep->object_count) {
+		printf("ERROR in kmem_check_consistency: cache %s has %u objects in magazines, object_count is %u\n", cachep->name, cached, cachep->object_count);
+		errors++;
+	}
+
+	slab_lists_unlock(cachep);
+
+	//*****************************mutex signal************************************
+	cache_unlock(cachep);
+	//*****************************************************************************
+
+	return errors;
+}
+
+int kmem_check_consistency()
+{
+	// validates buddy allocator and every cache, meant for tests and debugging
+	// allocations may run in parallel, every structure is checked under its own lock
+	int errors = b_check_consistency();
+
+	//*****************************mutex wait************************************
+	// could not get mutex
+	if (mutex_lock(&kmem_header->cache_list_mutex) != 0) {
+		return errors;
+	}
+	//***************************************************************************
+
+	for (kmem_cache_t* curr = kmem_header->cache_head; curr; curr = curr->next) {
+		errors += cache_check(curr);
+		if (cache_lookup_locked(curr->name) != curr) {
+			printf("ERROR in kmem_check_consistency: cache %s is not in registry\n", curr->name);
+			errors++;
+		}
+	}
+
+	//*****************************mutex signal************************************
+	if (mutex_unlock(&kmem_header->cache_list_mutex) != 0) {
+		printf("Error in releasing mutex for list of all caches\n");
+	}
+	//*****************************************************************************
+
+	return errors;
+}
+
 int kmem_cache_error(kmem_cache_t* cachep)
 {
 	printf("ERROR CODE: %d\n", cachep->error_code);